@@ -0,0 +1,853 @@
+
+#ifndef INCLUDE__FLAT_GROVE_HXX
+
+#define INCLUDE__FLAT_GROVE_HXX
+
+#include <istream>
+#include <ostream>
+
+#include <cmath>
+#include <cstring>
+#include <sstream>
+#include <stdint.h>
+
+#include <algorithm>
+#include <map>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "util.hxx"
+
+#include "stats.hxx"
+
+enum flat_node_type
+{
+	FN_TYPE_LEAF = 0,
+	FN_TYPE_BINARY = 1,
+	FN_TYPE_CONTINUOUS = 2
+};
+
+static const uint32_t FN_TYPE_BITS = 2;
+static const uint32_t FN_TYPE_MASK = (1 << FN_TYPE_BITS) - 1;
+static const uint32_t FN_MAX_NODES = static_cast<uint32_t>(-1) >> FN_TYPE_BITS;
+
+// Packed inference node. Siblings are always stored next to each other, so a
+// single child index is enough: the left child is at child(), the right one
+// right after it. Binary splits keep BINARY_THRESHOLD as their value, which
+// lets the traversal treat both split types the same way.
+template<typename T>
+struct flat_node
+{
+	T value_;
+	uint32_t v_;
+	uint32_t child_type_;
+
+	inline flat_node_type type() const
+	{
+		return static_cast<flat_node_type>(child_type_ & FN_TYPE_MASK);
+	}
+
+	inline uint32_t child() const
+	{
+		return child_type_ >> FN_TYPE_BITS;
+	}
+
+	inline void set(flat_node_type type, T value, size_t v, size_t child)
+	{
+#ifndef NDEBUG
+		FLEX_ASSERT(child <= FN_MAX_NODES);
+#endif
+
+		value_ = value;
+		v_ = v;
+		child_type_ = (static_cast<uint32_t>(child) << FN_TYPE_BITS) | type;
+	}
+};
+
+// Reduced-width node of quantized binary models: the value as a float or as
+// a fixed-point multiple of the step in the header (half the step for split
+// values, see quantize_split), and one word holding the child index, the
+// predictor index in v_bits bits and the type. Binary splits store no value
+// and always compare against BINARY_THRESHOLD.
+struct packed_node
+{
+	uint32_t value_;
+	uint32_t word_;
+
+	inline flat_node_type type() const
+	{
+		return static_cast<flat_node_type>(word_ & FN_TYPE_MASK);
+	}
+
+	inline uint32_t v(uint32_t v_bits) const
+	{
+		return (word_ >> FN_TYPE_BITS) & ((static_cast<uint32_t>(1) << v_bits) - 1);
+	}
+
+	inline uint32_t child(uint32_t v_bits) const
+	{
+		return word_ >> (FN_TYPE_BITS + v_bits);
+	}
+
+	inline void set(flat_node_type type, uint32_t value, size_t v, size_t child, uint32_t v_bits)
+	{
+		value_ = value;
+		word_ = (static_cast<uint32_t>(child) << (FN_TYPE_BITS + v_bits)) | (static_cast<uint32_t>(v) << FN_TYPE_BITS) | type;
+	}
+};
+
+static const char FLAT_GROVE_MAGIC[8] = { 'R', 'G', 'R', 'O', 'V', 'E', 'B', 'N' };
+static const uint32_t FLAT_GROVE_VERSION = 2;
+static const uint32_t FLAT_GROVE_BYTE_ORDER = 0x01020304;
+static const size_t FLAT_GROVE_ALIGNMENT = 16;
+
+// Binary model layout: this header, tree_num_ root offsets, padding up to
+// FLAT_GROVE_ALIGNMENT, node_num_ nodes. Everything is in host byte order
+// and the nodes are used in place, so the file only loads on a host with the
+// same byte order and the same fp_type it was written with. node_size_ tells
+// the node layout apart: flat_node<T>, or packed_node for a model quantized
+// as recorded in quantization_, leaf_step_ and split_step_.
+struct flat_grove_header
+{
+	char magic_[8];
+	uint32_t version_;
+	uint32_t byte_order_;
+	uint32_t node_size_;
+	uint32_t quantization_;
+	uint64_t dim_n_, dim_v_;
+	uint64_t tree_num_, node_num_;
+	uint32_t v_bits_;
+	uint32_t reserved_;
+	double leaf_step_, split_step_;
+};
+
+inline size_t flat_grove_nodes_offset(size_t tree_num)
+{
+	size_t offset = sizeof(flat_grove_header) + (tree_num * sizeof(uint32_t));
+
+	return ((offset + FLAT_GROVE_ALIGNMENT - 1) / FLAT_GROVE_ALIGNMENT) * FLAT_GROVE_ALIGNMENT;
+}
+
+inline bool is_flat_grove(std::istream &in)
+{
+	char magic[sizeof(FLAT_GROVE_MAGIC)];
+
+	in.read(magic, sizeof(magic));
+
+	bool result = in.good() && (std::memcmp(magic, FLAT_GROVE_MAGIC, sizeof(magic)) == 0);
+
+	in.clear();
+	in.seekg(0);
+
+	return result;
+}
+
+enum quantization
+{
+	QUANTIZE_NONE,
+	QUANTIZE_FLOAT,
+	QUANTIZE_FIXED
+};
+
+struct compaction_options
+{
+	// Rounding applied to leaf predictions and continuous split values: none,
+	// to float, or to the steps below (see quantize and quantize_split).
+	quantization quantization_;
+	fp_type leaf_step_, split_step_;
+
+	compaction_options():
+			quantization_(QUANTIZE_NONE), leaf_step_(1e-3), split_step_(1e-3)
+	{
+	}
+};
+
+// Applies a "key=value" compaction setting, returning false for unknown keys.
+inline bool set_compaction_option(compaction_options &options, const std::string &key, const std::string &value)
+{
+	std::stringstream value_stream(value);
+
+	if (key == "quantize")
+	{
+		if (value == "none")
+		{
+			options.quantization_ = QUANTIZE_NONE;
+		}
+		else if (value == "float")
+		{
+			options.quantization_ = QUANTIZE_FLOAT;
+		}
+		else if (value == "fixed")
+		{
+			options.quantization_ = QUANTIZE_FIXED;
+		}
+		else
+		{
+			return false;
+		}
+	}
+	else if (key == "leaf_step")
+	{
+		value_stream >> options.leaf_step_;
+	}
+	else if (key == "split_step")
+	{
+		value_stream >> options.split_step_;
+	}
+	else
+	{
+		return false;
+	}
+
+	return true;
+}
+
+template<typename T>
+inline T quantize(T value, quantization q, T step)
+{
+	if (q == QUANTIZE_FLOAT)
+	{
+		return static_cast<float>(value);
+	}
+	else if (q == QUANTIZE_FIXED)
+	{
+		return std::floor((value / step) + 0.5) * step;
+	}
+	else
+	{
+		return value;
+	}
+}
+
+// Split values are observed values with equal ones going right, so rounding
+// one up would send those observations left. They are rounded down instead:
+// to the float at or below, or half a step below the nearest multiple of the
+// step, which keeps values recorded at that step on their side.
+template<typename T>
+inline T quantize_split(T value, quantization q, T step)
+{
+	if (q == QUANTIZE_FLOAT)
+	{
+		float f = value;
+
+		return (f > value) ? std::nextafter(f, -HUGE_VALF) : f;
+	}
+	else if (q == QUANTIZE_FIXED)
+	{
+		return ((2 * std::floor((value / step) + 0.5)) - 1) * (step / 2);
+	}
+	else
+	{
+		return value;
+	}
+}
+
+template<typename T>
+inline T unpack_value(uint32_t bits, quantization q, T step)
+{
+	if (q == QUANTIZE_FLOAT)
+	{
+		float f;
+
+		std::memcpy(&f, &bits, sizeof(f));
+
+		return f;
+	}
+	else
+	{
+		int32_t i;
+
+		std::memcpy(&i, &bits, sizeof(i));
+
+		return i * step;
+	}
+}
+
+// Stores a value quantized with q (never QUANTIZE_NONE) in 32 bits, returning
+// false if it does not survive the round trip through unpack_value.
+template<typename T>
+inline bool pack_value(T value, quantization q, T step, uint32_t &bits)
+{
+	if (q == QUANTIZE_FLOAT)
+	{
+		float f = value;
+
+		std::memcpy(&bits, &f, sizeof(bits));
+	}
+	else
+	{
+		T k = std::floor((value / step) + 0.5);
+
+		if ((k < INT32_MIN) || (k > INT32_MAX))
+		{
+			return false;
+		}
+
+		int32_t i = k;
+
+		std::memcpy(&bits, &i, sizeof(bits));
+	}
+
+	return unpack_value<T>(bits, q, step) == value;
+}
+
+// All trees of a grove in one contiguous node array, each tree rooted at the
+// offset recorded in roots_. The arrays are either owned (training, text
+// model) or borrowed from a binary model image, typically a read-only memory
+// mapping that outlives the grove. Borrowed packed nodes are only read.
+template<typename T, typename X>
+class flat_grove
+{
+	private:
+	std::vector<flat_node<T> > nodes_storage_;
+	std::vector<uint32_t> roots_storage_;
+
+	const flat_node<T> *nodes_;
+	const packed_node *packed_;
+	const uint32_t *roots_;
+	size_t node_num_, tree_num_;
+
+	// Quantization applied by compact() or read from the header, and the
+	// predictor index width of packed_node, 0 if the nodes do not fit it.
+	compaction_options compaction_;
+	uint32_t v_bits_;
+
+	void sync()
+	{
+		nodes_ = nodes_storage_.empty() ? NULL : &nodes_storage_[0];
+		packed_ = NULL;
+		roots_ = roots_storage_.empty() ? NULL : &roots_storage_[0];
+		node_num_ = nodes_storage_.size();
+		tree_num_ = roots_storage_.size();
+	}
+
+	inline T value(const packed_node &node) const
+	{
+		if (node.type() == FN_TYPE_BINARY)
+		{
+			return BINARY_THRESHOLD;
+		}
+
+		return unpack_value<T>(node.value_, compaction_.quantization_,
+				(node.type() == FN_TYPE_LEAF) ? compaction_.leaf_step_ : (compaction_.split_step_ / 2));
+	}
+
+	// Node ix as a flat_node<T>, whichever layout the grove uses.
+	inline flat_node<T> node(size_t ix) const
+	{
+		if (packed_ == NULL)
+		{
+			return nodes_[ix];
+		}
+
+		const packed_node &node = packed_[ix];
+
+		flat_node<T> result;
+
+		result.set(node.type(), value(node), node.v(v_bits_), node.child(v_bits_));
+
+		return result;
+	}
+
+	bool pack(const flat_node<T> &node, uint32_t v_bits, packed_node &result) const
+	{
+		uint32_t bits = 0;
+		bool fits = true;
+
+		if (node.type() != FN_TYPE_BINARY)
+		{
+			fits = pack_value<T>(node.value_, compaction_.quantization_,
+					(node.type() == FN_TYPE_LEAF) ? compaction_.leaf_step_ : (compaction_.split_step_ / 2), bits);
+		}
+
+		result.set(node.type(), bits, node.v_, node.child(), v_bits);
+
+		return fits;
+	}
+
+	// Smallest v_bits that holds every predictor index, or 0 if the grove is
+	// not quantized or some value or child index does not fit a packed_node.
+	uint32_t packed_v_bits() const
+	{
+		if (compaction_.quantization_ == QUANTIZE_NONE)
+		{
+			return 0;
+		}
+
+		uint32_t max_v = 0;
+
+		for (size_t ix = 0; ix != node_num_; ++ix)
+		{
+			if (nodes_[ix].type() != FN_TYPE_LEAF)
+			{
+				max_v = std::max(max_v, nodes_[ix].v_);
+			}
+		}
+
+		uint32_t v_bits = 1;
+
+		while ((max_v >> v_bits) != 0)
+		{
+			++v_bits;
+		}
+
+		if ((FN_TYPE_BITS + v_bits >= 32)
+				|| (static_cast<uint64_t>(node_num_) > (static_cast<uint64_t>(1) << (32 - FN_TYPE_BITS - v_bits))))
+		{
+			return 0;
+		}
+
+		packed_node packed;
+
+		for (size_t ix = 0; ix != node_num_; ++ix)
+		{
+			if (! pack(nodes_[ix], v_bits, packed))
+			{
+				return 0;
+			}
+		}
+
+		return v_bits;
+	}
+
+	typedef std::pair<uint64_t, T> node_key;
+
+	static node_key key(const flat_node<T> &node)
+	{
+		return node_key((static_cast<uint64_t>(node.child_type_) << 32) | node.v_, node.value_);
+	}
+
+	// Rebuilds the subtree at ix into nodes bottom-up and returns its new root
+	// node, which the caller stores. Child pairs equal to one already stored
+	// are shared instead of copied, and a split whose two (quantized) sides
+	// came out identical is replaced by either side.
+	flat_node<T> compact_node(size_t ix, const compaction_options &options, std::vector<flat_node<T> > &nodes,
+			std::map<std::pair<node_key, node_key>, size_t> &pairs,
+			std::vector<flat_node<T> > &memo, std::vector<bool> &done) const
+	{
+		if (done[ix])
+		{
+			return memo[ix];
+		}
+
+		const flat_node<T> &node = nodes_[ix];
+
+		flat_node<T> result;
+
+		if (node.type() == FN_TYPE_LEAF)
+		{
+			result.set(FN_TYPE_LEAF, quantize<T>(node.value_, options.quantization_, options.leaf_step_), 0, 0);
+		}
+		else
+		{
+			flat_node<T> a = compact_node(node.child(), options, nodes, pairs, memo, done);
+			flat_node<T> b = compact_node(node.child() + 1, options, nodes, pairs, memo, done);
+
+			if (key(a) == key(b))
+			{
+				result = a;
+			}
+			else
+			{
+				std::pair<node_key, node_key> pair_key(key(a), key(b));
+
+				typename std::map<std::pair<node_key, node_key>, size_t>::const_iterator pair_iter =
+						pairs.find(pair_key);
+
+				size_t child;
+
+				if (pair_iter != pairs.end())
+				{
+					child = pair_iter->second;
+				}
+				else
+				{
+					child = nodes.size();
+
+					nodes.push_back(a);
+					nodes.push_back(b);
+
+					pairs[pair_key] = child;
+				}
+
+				T value = (node.type() == FN_TYPE_CONTINUOUS)
+						? quantize_split<T>(node.value_, options.quantization_, options.split_step_)
+						: node.value_;
+
+				result.set(node.type(), value, node.v_, child);
+			}
+		}
+
+		memo[ix] = result;
+		done[ix] = true;
+
+		return result;
+	}
+
+	void serialize_node(std::ostream &out, size_t ix, size_t dim_n, size_t dim_v) const
+	{
+		flat_node<T> node = this->node(ix);
+
+		out << "regression_tree" << std::endl;
+		out << "{" << std::endl;
+
+		out << dim_n << " " << dim_v << std::endl;
+
+		if (node.type() == FN_TYPE_LEAF)
+		{
+			out << "RT_NODE_TYPE_LEAF" << std::endl;
+			out << node.value_ << std::endl;
+			out << 0 << std::endl;
+			out << T() << std::endl;
+			out << 0 << std::endl;
+		}
+		else
+		{
+			if (node.type() == FN_TYPE_BINARY)
+			{
+				out << "RT_NODE_TYPE_BINARY" << std::endl;
+			}
+			else
+			{
+				out << "RT_NODE_TYPE_CONTINUOUS" << std::endl;
+			}
+
+			out << T() << std::endl;
+			out << node.v_ << std::endl;
+			out << ((node.type() == FN_TYPE_BINARY) ? T() : node.value_) << std::endl;
+			out << 2 << std::endl;
+		}
+
+		out << "{" << std::endl;
+
+		if (node.type() != FN_TYPE_LEAF)
+		{
+			serialize_node(out, node.child(), dim_n, dim_v);
+			serialize_node(out, node.child() + 1, dim_n, dim_v);
+		}
+
+		out << "}" << std::endl;
+
+		out << "}" << std::endl;
+	}
+
+	public:
+	flat_grove():
+			nodes_storage_(), roots_storage_(), nodes_(NULL), packed_(NULL), roots_(NULL), node_num_(0), tree_num_(0),
+			compaction_(), v_bits_(0)
+	{
+	}
+
+	flat_grove(const flat_grove<T, X> &that):
+			nodes_storage_(that.nodes_storage_), roots_storage_(that.roots_storage_),
+			nodes_(that.nodes_), packed_(that.packed_), roots_(that.roots_), node_num_(that.node_num_),
+			tree_num_(that.tree_num_), compaction_(that.compaction_), v_bits_(that.v_bits_)
+	{
+		if (! nodes_storage_.empty())
+		{
+			sync();
+		}
+	}
+
+	flat_grove<T, X> &operator=(const flat_grove<T, X> &that)
+	{
+		nodes_storage_ = that.nodes_storage_;
+		roots_storage_ = that.roots_storage_;
+		nodes_ = that.nodes_;
+		packed_ = that.packed_;
+		roots_ = that.roots_;
+		node_num_ = that.node_num_;
+		tree_num_ = that.tree_num_;
+		compaction_ = that.compaction_;
+		v_bits_ = that.v_bits_;
+
+		if (! nodes_storage_.empty())
+		{
+			sync();
+		}
+
+		return *this;
+	}
+
+	// Anything that knows how to flatten itself into a node array will do,
+	// in practice a freshly trained or parsed regression_tree.
+	template<typename R>
+	void append(const R &tree)
+	{
+#ifndef NDEBUG
+		FLEX_ASSERT(nodes_ == (nodes_storage_.empty() ? NULL : &nodes_storage_[0]));
+#endif
+
+		size_t root = nodes_storage_.size();
+
+		roots_storage_.push_back(root);
+		nodes_storage_.resize(root + 1);
+
+		tree.flatten(nodes_storage_, root);
+
+#ifndef NDEBUG
+		FLEX_ASSERT(nodes_storage_.size() <= FN_MAX_NODES);
+#endif
+
+		v_bits_ = 0;
+
+		sync();
+	}
+
+	// Appends all trees of another owned grove, in order.
+	void append_grove(const flat_grove<T, X> &that)
+	{
+#ifndef NDEBUG
+		FLEX_ASSERT(nodes_ == (nodes_storage_.empty() ? NULL : &nodes_storage_[0]));
+		FLEX_ASSERT(that.packed_ == NULL);
+		FLEX_ASSERT(nodes_storage_.size() + that.node_num_ <= FN_MAX_NODES);
+#endif
+
+		size_t base = nodes_storage_.size();
+
+		for (size_t t = 0; t != that.tree_num_; ++t)
+		{
+			roots_storage_.push_back(base + that.roots_[t]);
+		}
+
+		nodes_storage_.insert(nodes_storage_.end(), that.nodes_, that.nodes_ + that.node_num_);
+
+		for (size_t ix = base; ix != nodes_storage_.size(); ++ix)
+		{
+			flat_node<T> &node = nodes_storage_[ix];
+
+			if (node.type() != FN_TYPE_LEAF)
+			{
+				node.set(node.type(), node.value_, node.v_, base + node.child());
+			}
+		}
+
+		v_bits_ = 0;
+
+		sync();
+	}
+
+	// Points the grove at a binary model image without copying it. The image
+	// must stay valid for as long as the grove is used.
+	const flat_grove_header &attach(const char *data, size_t size)
+	{
+#ifndef NDEBUG
+		FLEX_ASSERT(size >= sizeof(flat_grove_header));
+#endif
+
+		const flat_grove_header &header = *reinterpret_cast<const flat_grove_header *>(data);
+
+#ifndef NDEBUG
+		FLEX_ASSERT(std::memcmp(header.magic_, FLAT_GROVE_MAGIC, sizeof(FLAT_GROVE_MAGIC)) == 0);
+		FLEX_ASSERT(header.version_ == FLAT_GROVE_VERSION);
+		FLEX_ASSERT(header.byte_order_ == FLAT_GROVE_BYTE_ORDER);
+		FLEX_ASSERT((header.node_size_ == sizeof(flat_node<T>)) || ((header.node_size_ == sizeof(packed_node))
+				&& (header.quantization_ != QUANTIZE_NONE) && (header.v_bits_ > 0) && (FN_TYPE_BITS + header.v_bits_ < 32)));
+		FLEX_ASSERT(header.node_num_ <= FN_MAX_NODES);
+		FLEX_ASSERT(size >= flat_grove_nodes_offset(header.tree_num_) + (header.node_num_ * header.node_size_));
+#endif
+
+		nodes_storage_.clear();
+		roots_storage_.clear();
+
+		const char *nodes = data + flat_grove_nodes_offset(header.tree_num_);
+
+		bool packed = (header.node_size_ == sizeof(packed_node));
+
+		roots_ = reinterpret_cast<const uint32_t *>(data + sizeof(flat_grove_header));
+		nodes_ = packed ? NULL : reinterpret_cast<const flat_node<T> *>(nodes);
+		packed_ = packed ? reinterpret_cast<const packed_node *>(nodes) : NULL;
+		tree_num_ = header.tree_num_;
+		node_num_ = header.node_num_;
+
+		compaction_.quantization_ = static_cast<quantization>(header.quantization_);
+		compaction_.leaf_step_ = header.leaf_step_;
+		compaction_.split_step_ = header.split_step_;
+		v_bits_ = packed ? header.v_bits_ : 0;
+
+		return header;
+	}
+
+	// Shrinks the grove in place (see compact_node), turning the trees into
+	// DAGs that share identical subtrees. Identical trees share their root.
+	// Prediction is unaffected unless options ask for quantization, in which
+	// case write() stores packed nodes if the grove fits them.
+	void compact(const compaction_options &options)
+	{
+#ifndef NDEBUG
+		FLEX_ASSERT(packed_ == NULL);
+#endif
+
+		std::vector<flat_node<T> > nodes;
+		std::vector<uint32_t> roots;
+
+		std::map<std::pair<node_key, node_key>, size_t> pairs;
+		std::map<node_key, size_t> tops;
+
+		std::vector<flat_node<T> > memo(node_num_);
+		std::vector<bool> done(node_num_, false);
+
+		for (size_t t = 0; t != tree_num_; ++t)
+		{
+			flat_node<T> root = compact_node(roots_[t], options, nodes, pairs, memo, done);
+
+			typename std::map<node_key, size_t>::const_iterator top_iter = tops.find(key(root));
+
+			if (top_iter != tops.end())
+			{
+				roots.push_back(top_iter->second);
+			}
+			else
+			{
+				roots.push_back(nodes.size());
+
+				tops[key(root)] = nodes.size();
+
+				nodes.push_back(root);
+			}
+		}
+
+		nodes_storage_.swap(nodes);
+		roots_storage_.swap(roots);
+
+		sync();
+
+		compaction_ = options;
+		v_bits_ = packed_v_bits();
+	}
+
+	void write(std::ostream &out, size_t dim_n, size_t dim_v) const
+	{
+		flat_grove_header header;
+
+		std::memset(&header, 0, sizeof(header));
+		std::memcpy(header.magic_, FLAT_GROVE_MAGIC, sizeof(FLAT_GROVE_MAGIC));
+		header.version_ = FLAT_GROVE_VERSION;
+		header.byte_order_ = FLAT_GROVE_BYTE_ORDER;
+		header.node_size_ = node_size();
+		header.quantization_ = compaction_.quantization_;
+		header.dim_n_ = dim_n;
+		header.dim_v_ = dim_v;
+		header.tree_num_ = tree_num_;
+		header.node_num_ = node_num_;
+		header.v_bits_ = v_bits_;
+		header.leaf_step_ = compaction_.leaf_step_;
+		header.split_step_ = compaction_.split_step_;
+
+		out.write(reinterpret_cast<const char *>(&header), sizeof(header));
+		out.write(reinterpret_cast<const char *>(roots_), tree_num_ * sizeof(uint32_t));
+
+		std::string padding(flat_grove_nodes_offset(tree_num_)
+				- sizeof(flat_grove_header) - (tree_num_ * sizeof(uint32_t)), '\0');
+
+		out.write(padding.data(), padding.size());
+
+		if (packed_ != NULL)
+		{
+			out.write(reinterpret_cast<const char *>(packed_), node_num_ * sizeof(packed_node));
+		}
+		else if (v_bits_ != 0)
+		{
+			std::vector<packed_node> packed(node_num_);
+
+			for (size_t ix = 0; ix != node_num_; ++ix)
+			{
+				pack(nodes_[ix], v_bits_, packed[ix]);
+			}
+
+			out.write(reinterpret_cast<const char *>(&packed[0]), node_num_ * sizeof(packed_node));
+		}
+		else
+		{
+			out.write(reinterpret_cast<const char *>(nodes_), node_num_ * sizeof(flat_node<T>));
+		}
+	}
+
+	// Prediction of tree t for observation i of x, any predictor storage with
+	// an XV overload.
+	template<typename Z>
+	inline T predict(size_t t, const Z &x, size_t i, size_t dim_v) const
+	{
+		if (packed_ != NULL)
+		{
+			const packed_node *node = packed_ + roots_[t];
+
+			while (node->type() != FN_TYPE_LEAF)
+			{
+				node = packed_ + node->child(v_bits_) + ((XV(x, i, node->v(v_bits_), dim_v) < value(*node)) ? 0 : 1);
+			}
+
+			return value(*node);
+		}
+
+		const flat_node<T> *node = nodes_ + roots_[t];
+
+		while (node->type() != FN_TYPE_LEAF)
+		{
+			node = nodes_ + node->child() + ((XV(x, i, node->v_, dim_v) < node->value_) ? 0 : 1);
+		}
+
+		return node->value_;
+	}
+
+	void serialize(std::ostream &out, size_t t, size_t dim_n, size_t dim_v) const
+	{
+		serialize_node(out, roots_[t], dim_n, dim_v);
+	}
+
+	size_t size() const
+	{
+		return tree_num_;
+	}
+
+	size_t node_count() const
+	{
+		return node_num_;
+	}
+
+	// Size of one node as write() stores it.
+	size_t node_size() const
+	{
+		return (v_bits_ != 0) ? sizeof(packed_node) : sizeof(flat_node<T>);
+	}
+
+	size_t bytes() const
+	{
+		return (node_num_ * node_size()) + (tree_num_ * sizeof(uint32_t));
+	}
+
+	// Bytes of the nodes reachable from the root of tree t (counting nodes it
+	// shares with itself or other trees at every visit) and the depth of its
+	// deepest leaf, the root being at depth 0.
+	std::pair<size_t, size_t> tree_shape(size_t t) const
+	{
+		size_t nodes = 0;
+		size_t depth = 0;
+
+		std::vector<std::pair<size_t, size_t> > stack(1, std::make_pair(static_cast<size_t>(roots_[t]), 0));
+
+		while (! stack.empty())
+		{
+			std::pair<size_t, size_t> top = stack.back();
+
+			stack.pop_back();
+
+			++nodes;
+			depth = std::max(depth, top.second);
+
+			flat_node<T> node = this->node(top.first);
+
+			if (node.type() != FN_TYPE_LEAF)
+			{
+				stack.push_back(std::make_pair(static_cast<size_t>(node.child()), top.second + 1));
+				stack.push_back(std::make_pair(static_cast<size_t>(node.child() + 1), top.second + 1));
+			}
+		}
+
+		return std::make_pair(nodes * node_size(), depth);
+	}
+};
+
+#endif
+
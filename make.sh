@@ -1,5 +1,8 @@
 #!/bin/sh
 
-g++ -std=c++0x -pedantic -Wall -Wextra -O3 -o rg-train rg-train.cxx
-g++ -std=c++0x -pedantic -Wall -Wextra -O3 -o rg-gearman-worker rg-gearman-worker.cxx -lgearman
+g++ -std=c++0x -pedantic -Wall -Wextra -O3 -o rg-train rg-train.cxx -pthread
+g++ -std=c++0x -pedantic -Wall -Wextra -O3 -o rg-convert rg-convert.cxx -pthread
+g++ -std=c++0x -pedantic -Wall -Wextra -O3 -o rg-convert-data rg-convert-data.cxx
+g++ -std=c++0x -pedantic -Wall -Wextra -O3 -o rg-bench rg-bench.cxx -pthread
+g++ -std=c++0x -pedantic -Wall -Wextra -O3 -o rg-gearman-worker rg-gearman-worker.cxx -lgearman -pthread
 
@@ -0,0 +1,68 @@
+
+#ifndef INCLUDE__MAPPED_FILE_HXX
+
+#define INCLUDE__MAPPED_FILE_HXX
+
+#include <string>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "util.hxx"
+
+// Read-only shared mapping of a whole file. Pages come straight from the page
+// cache, so every process mapping the same file shares one copy of it.
+class mapped_file
+{
+	private:
+	const char *data_;
+	size_t size_;
+
+	mapped_file(const mapped_file &);
+	mapped_file &operator=(const mapped_file &);
+
+	public:
+	mapped_file(const std::string &path):
+			data_(NULL), size_(0)
+	{
+		int fd = open(path.c_str(), O_RDONLY);
+
+		FLEX_ASSERT(fd != -1);
+
+		struct stat st;
+
+		int status = fstat(fd, &st);
+
+		FLEX_ASSERT(status == 0);
+
+		size_ = st.st_size;
+
+		void *data = mmap(NULL, size_, PROT_READ, MAP_SHARED, fd, 0);
+
+		FLEX_ASSERT(data != MAP_FAILED);
+
+		close(fd);
+
+		data_ = static_cast<const char *>(data);
+	}
+
+	~mapped_file()
+	{
+		munmap(const_cast<char *>(data_), size_);
+	}
+
+	const char *data() const
+	{
+		return data_;
+	}
+
+	size_t size() const
+	{
+		return size_;
+	}
+};
+
+#endif
+
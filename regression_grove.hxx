@@ -8,33 +8,59 @@
 #include <ostream>
 
 #include <cstdlib>
+#include <stdint.h>
 
+#include <algorithm>
+#include <atomic>
 #include <iterator>
+#include <mutex>
+#include <thread>
 #include <vector>
 
 #include "util.hxx"
 
+#include "flat_grove.hxx"
 #include "regression_tree.hxx"
 
+static const size_t PREDICT_BATCH_BLOCK = 256;
+
 template<typename T>
 inline T SAMPLE_VARIABLES(T v)
 {
 	return v / 3;
 }
 
+struct training_options
+{
+	// Number of trees trained concurrently.
+	size_t threads_;
+	// Lets threads that ran out of trees help with large subtrees.
+	bool parallel_subtrees_;
+	// Tree t is grown from a generator seeded by seed_ and t alone, so the
+	// same seed yields the same grove for any number of threads.
+	uint64_t seed_;
+	tree_limits limits_;
+
+	training_options():
+			threads_(1), parallel_subtrees_(true), seed_(0), limits_()
+	{
+	}
+};
+
 template<typename T, typename Y, typename X, typename L>
 class regression_grove
 {
 	private:
 	bool trained_;
 	size_t dim_n_, dim_v_;
-	std::vector<regression_tree<T, Y, X, std::vector<size_t>, L> > grove_;
+	flat_grove<T, X> grove_;
 
 	public:
-	regression_grove(const Y &y, const X &x, const L &l, size_t n, std::ostream &log):
+	regression_grove(const Y &y, const X &x, const L &l, size_t n, std::ostream &log,
+			const training_options &options = training_options()):
 			trained_(false), dim_n_(y.size()), dim_v_(x.size() / dim_n_), grove_()
 	{
-		train(y, x, l, n, log);
+		train(y, x, l, n, log, options);
 	}
 
 	regression_grove(std::istream &in):
@@ -54,7 +80,7 @@ class regression_grove
 
 		for (size_t i = 0; i != grove_size; ++i)
 		{
-			grove_.push_back(regression_tree<T, Y, X, std::vector<size_t>, L>(in));
+			grove_.append(regression_tree<T, Y, X, std::vector<size_t>, L>(in));
 
 #ifdef LOG_OUTPUT_RG_TICK
 			std::cerr << "#";
@@ -70,7 +96,19 @@ class regression_grove
 		expect(in, "}");
 	}
 
-	void train(const Y &y, const X &x, const L &l, size_t n, std::ostream &log)
+	// Predicts straight from a binary model image (see flat_grove_header),
+	// which has to outlive the grove.
+	regression_grove(const char *data, size_t size):
+			trained_(true), dim_n_(), dim_v_(), grove_()
+	{
+		const flat_grove_header &header = grove_.attach(data, size);
+
+		dim_n_ = header.dim_n_;
+		dim_v_ = header.dim_v_;
+	}
+
+	void train(const Y &y, const X &x, const L &l, size_t n, std::ostream &log,
+			const training_options &options = training_options())
 	{
 #ifndef NDEBUG
 		FLEX_ASSERT(! trained_);
@@ -80,29 +118,73 @@ class regression_grove
 		log << "Training regression grove of " << n << " trees..." << std::endl;
 #endif
 
-		std::vector<size_t> ix(dim_n_);
+		presorted_predictors<T> presorted(x, l, dim_n_, dim_v_);
 
-		for (size_t i = 0; i != n; ++i)
+		std::vector<flat_grove<T, X> > trees(n);
+
+		// Threads beyond the number of trees have no tree of their own, so they
+		// only ever take over subtrees, from the start.
+		std::atomic<size_t> next_tree(0);
+		thread_budget budget(options.threads_ - std::min(options.threads_, n));
+		std::mutex log_mutex;
+
+		auto train_trees = [&]()
 		{
+			std::vector<size_t> ix(dim_n_);
+
+			for (size_t i = next_tree++; i < n; i = next_tree++)
+			{
 #ifdef LOG_OUTPUT
-			log << "Training tree #" << (i + 1) << "..." << std::endl;
+				{
+					std::lock_guard<std::mutex> lock(log_mutex);
+
+					log << "Training tree #" << (i + 1) << "..." << std::endl;
+				}
 #endif
 
-			for (size_t j = 0; j != dim_n_; ++j)
-			{
-				ix[j] = floor((static_cast<double>(std::rand()) / static_cast<double>(RAND_MAX)) * dim_n_);
-			}
+				splitmix64 rng(splitmix64::mix(options.seed_ + i));
 
-			grove_.push_back(regression_tree<T, Y, X, std::vector<size_t>, L>(
-					y, x, ix, l, SAMPLE_VARIABLES(dim_v_), log));
+				for (size_t j = 0; j != dim_n_; ++j)
+				{
+					ix[j] = rng() % dim_n_;
+				}
+
+				trees[i].append(regression_tree<T, Y, X, std::vector<size_t>, L>(
+						y, x, ix, l, presorted, SAMPLE_VARIABLES(dim_v_), options.limits_, rng(),
+						options.parallel_subtrees_ ? &budget : NULL, log));
+
+				std::lock_guard<std::mutex> lock(log_mutex);
 
 #ifdef LOG_OUTPUT
-			log << "Done training tree #" << (i + 1) << "." << std::endl;
+				log << "Done training tree #" << (i + 1) << "." << std::endl;
 #endif
 
 #ifdef LOG_OUTPUT_RG_TICK
-			std::cerr << "Done training tree #" << (i + 1) << "." << std::endl;
+				std::cerr << "Done training tree #" << (i + 1) << "." << std::endl;
 #endif
+			}
+
+			// Nothing left to start, so this thread is free to take over subtrees.
+			budget.release();
+		};
+
+		std::vector<std::thread> workers;
+
+		for (size_t k = 1; k < std::min(options.threads_, n); ++k)
+		{
+			workers.push_back(std::thread(train_trees));
+		}
+
+		train_trees();
+
+		for (std::vector<std::thread>::iterator worker_iter = workers.begin(); worker_iter != workers.end(); ++worker_iter)
+		{
+			worker_iter->join();
+		}
+
+		for (size_t i = 0; i != n; ++i)
+		{
+			grove_.append_grove(trees[i]);
 		}
 
 #ifdef LOG_OUTPUT
@@ -118,17 +200,79 @@ class regression_grove
 		FLEX_ASSERT(trained_);
 #endif
 
-		std::vector<T> predictions;
+		std::vector<T> predictions(grove_.size());
 
-		for (typename std::vector<regression_tree<T, Y, X, std::vector<size_t>, L> >::const_iterator
-				grove_iter = grove_.begin(); grove_iter != grove_.end(); ++grove_iter)
+		for (size_t t = 0; t != grove_.size(); ++t)
 		{
-			predictions.push_back(grove_iter->predict(x, i));
+			predictions[t] = grove_.predict(t, x, i, dim_v_);
 		}
 
 		return predictions;
 	}
 
+	// Scores count observations starting at row i of x, writing one prediction
+	// per tree and observation to predictions, which must have room for
+	// count * size() values laid out row-major like the result of predict().
+	// Rows go through the grove a block at a time and tree by tree, so each
+	// tree stays in cache while the whole block is pushed through it.
+	void predict_batch(const X &x, size_t i, size_t count, T *predictions) const
+	{
+#ifndef NDEBUG
+		FLEX_ASSERT(trained_);
+#endif
+
+		size_t tree_num = grove_.size();
+
+		for (size_t block = 0; block < count; block += PREDICT_BATCH_BLOCK)
+		{
+			size_t block_end = std::min(count, block + PREDICT_BATCH_BLOCK);
+
+			for (size_t t = 0; t != tree_num; ++t)
+			{
+				for (size_t j = block; j != block_end; ++j)
+				{
+					predictions[(j * tree_num) + t] = grove_.predict(t, x, i + j, dim_v_);
+				}
+			}
+		}
+	}
+
+	// Mean prediction of all trees for each of the first n observations of z,
+	// any predictor storage with an XV overload (such as training_data).
+	template<typename Z>
+	std::vector<T> predict_mean(const Z &z, size_t n) const
+	{
+#ifndef NDEBUG
+		FLEX_ASSERT(trained_);
+#endif
+
+		std::vector<T> means(n, T());
+
+		for (size_t t = 0; t != grove_.size(); ++t)
+		{
+			for (size_t i = 0; i != n; ++i)
+			{
+				means[i] += grove_.predict(t, z, i, dim_v_);
+			}
+		}
+
+		for (size_t i = 0; i != n; ++i)
+		{
+			means[i] /= grove_.size();
+		}
+
+		return means;
+	}
+
+	void compact(const compaction_options &options)
+	{
+#ifndef NDEBUG
+		FLEX_ASSERT(trained_);
+#endif
+
+		grove_.compact(options);
+	}
+
 	void serialize(std::ostream &out) const
 	{
 #ifndef NDEBUG
@@ -143,10 +287,9 @@ class regression_grove
 		out << grove_.size() << std::endl;
 		out << "{" << std::endl;
 
-		for (typename std::vector<regression_tree<T, Y, X, std::vector<size_t>, L> >::const_iterator
-				grove_iter = grove_.begin(); grove_iter != grove_.end(); ++grove_iter)
+		for (size_t t = 0; t != grove_.size(); ++t)
 		{
-			grove_iter->serialize(out);
+			grove_.serialize(out, t, dim_n_, dim_v_);
 
 #ifdef LOG_OUTPUT_RG_TICK
 			std::cerr << "#";
@@ -162,10 +305,39 @@ class regression_grove
 		out << "}" << std::endl;
 	}
 
+	void serialize_binary(std::ostream &out) const
+	{
+#ifndef NDEBUG
+		FLEX_ASSERT(trained_);
+#endif
+
+		grove_.write(out, dim_n_, dim_v_);
+	}
+
 	const size_t &v() const
 	{
 		return dim_v_;
 	}
+
+	size_t size() const
+	{
+		return grove_.size();
+	}
+
+	size_t node_count() const
+	{
+		return grove_.node_count();
+	}
+
+	size_t bytes() const
+	{
+		return grove_.bytes();
+	}
+
+	std::pair<size_t, size_t> tree_shape(size_t t) const
+	{
+		return grove_.tree_shape(t);
+	}
 };
 
 #endif
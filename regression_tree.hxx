@@ -7,9 +7,13 @@
 #include <istream>
 #include <ostream>
 
+#include <stdint.h>
+
 #include <algorithm>
+#include <atomic>
 #include <iterator>
 #include <string>
+#include <thread>
 #include <utility>
 #include <vector>
 
@@ -17,8 +21,95 @@
 
 #include "stats.hxx"
 
+#include "flat_grove.hxx"
+
 static const fp_type TOLERANCE_THRESHOLD = 1e-6;
 
+static const size_t PARALLEL_SUBTREE_MIN_SIZE = 10000;
+
+// Stopping rules for growing a tree. The defaults grow it all the way, until
+// no split gains more than TOLERANCE_THRESHOLD.
+struct tree_limits
+{
+	// Nodes at this depth (the root being at depth 0) become leaves.
+	size_t max_depth_;
+	// Smallest number of observations either side of a split may get.
+	size_t min_leaf_size_;
+	// Splits have to gain more than this.
+	fp_type min_gain_;
+
+	tree_limits():
+			max_depth_(static_cast<size_t>(-1)), min_leaf_size_(1), min_gain_(TOLERANCE_THRESHOLD)
+	{
+	}
+};
+
+// Every continuous predictor's observations in ascending order of value,
+// sorted once for a whole grove. Trees derive the order of their bootstrap
+// samples from it in linear time instead of sorting them again.
+template<typename T>
+struct presorted_predictors
+{
+	std::vector<std::vector<presorted_observation<T> > > sorted_;
+
+	template<typename X, typename L>
+	presorted_predictors(const X &x, const L &l, size_t dim_n, size_t dim_v):
+			sorted_(dim_v)
+	{
+		for (size_t v = 0; v != dim_v; ++v)
+		{
+			if (l[v] == 0)
+			{
+				sorted_[v].resize(dim_n);
+
+				for (size_t i = 0; i != dim_n; ++i)
+				{
+					sorted_[v][i].x_ = XV(x, i, v, dim_v);
+					sorted_[v][i].i_ = i;
+				}
+
+				std::sort(sorted_[v].begin(), sorted_[v].end());
+			}
+		}
+	}
+};
+
+// Threads that training may borrow to build two sibling subtrees at once.
+class thread_budget
+{
+	private:
+	std::atomic<size_t> spare_;
+
+	thread_budget(const thread_budget &);
+	thread_budget &operator=(const thread_budget &);
+
+	public:
+	explicit thread_budget(size_t spare):
+			spare_(spare)
+	{
+	}
+
+	bool acquire()
+	{
+		size_t spare = spare_.load();
+
+		while (spare > 0)
+		{
+			if (spare_.compare_exchange_weak(spare, spare - 1))
+			{
+				return true;
+			}
+		}
+
+		return false;
+	}
+
+	void release()
+	{
+		++spare_;
+	}
+};
+
 template<typename T, typename Y, typename X, typename I, typename L>
 class regression_tree
 {
@@ -38,86 +129,111 @@ class regression_tree
 	T split_;
 	std::vector<regression_tree<T, Y, X, I, L> > children_;
 
-	public:
-	regression_tree(const Y &y, const X &x, const I &i, const L &l, size_t n, std::ostream &log):
-			dim_n_(y.size()), dim_v_(x.size() / dim_n_), node_type_(RT_NODE_TYPE_INVALID),
-			prediction_(), v_(), split_(), children_()
+	// The bootstrap sample of one tree. Every node owns the same [begin, end)
+	// range of rows_ and of each continuous predictor's copy of the rows,
+	// presorted by value and carrying the values along. Splitting a node flags
+	// the rows going to the first child in below_ and stably partitions all of
+	// them by that flag, so the per-predictor order survives down the tree
+	// without any further sorting, and sibling subtrees never touch the same
+	// elements (every copy of a row goes the same way).
+	struct training_sample
 	{
-		train(y, x, i, l, n, log);
-	}
+		I rows_;
+		std::vector<std::vector<presorted_observation<T> > > sorted_;
+		I scratch_;
+		std::vector<presorted_observation<T> > sorted_scratch_;
+		std::vector<char> below_;
+
+		training_sample(const I &i, const presorted_predictors<T> &presorted, size_t dim_n):
+				rows_(i), sorted_(presorted.sorted_.size()), scratch_(i.size()), sorted_scratch_(), below_(dim_n)
+		{
+			std::vector<size_t> counts(dim_n);
 
-	regression_tree(std::istream &in):
-			children_()
-	{
-		expect(in, "regression_tree");
-		expect(in, "{");
+			for (typename I::const_iterator i_iter = i.begin(); i_iter != i.end(); ++i_iter)
+			{
+				++counts[*i_iter];
+			}
 
-		in >> dim_n_;
-		in >> dim_v_;
+			for (size_t v = 0; v != sorted_.size(); ++v)
+			{
+				const std::vector<presorted_observation<T> > &all = presorted.sorted_[v];
 
-		std::string node_type_str;
+				if (! all.empty())
+				{
+					sorted_[v].resize(i.size());
 
-		in >> node_type_str;
+					typename std::vector<presorted_observation<T> >::iterator sorted_iter = sorted_[v].begin();
 
-		if (node_type_str == "RT_NODE_TYPE_LEAF")
-		{
-			node_type_ = RT_NODE_TYPE_LEAF;
-		}
-		else if (node_type_str == "RT_NODE_TYPE_BINARY")
-		{
-			node_type_ = RT_NODE_TYPE_BINARY;
-		}
-		else if (node_type_str == "RT_NODE_TYPE_CONTINUOUS")
-		{
-			node_type_ = RT_NODE_TYPE_CONTINUOUS;
-		}
-		else
-		{
-#ifndef NDEBUG
-			FLEX_ASSERT(false);
-#endif
+					for (typename std::vector<presorted_observation<T> >::const_iterator
+							all_iter = all.begin(); all_iter != all.end(); ++all_iter)
+					{
+						for (size_t k = counts[all_iter->i_]; k != 0; --k)
+						{
+							*sorted_iter++ = *all_iter;
+						}
+					}
 
-			node_type_ = RT_NODE_TYPE_INVALID;
+					sorted_scratch_.resize(i.size());
+				}
+			}
 		}
 
-		in >> prediction_;
-		in >> v_;
-		in >> split_;
-
-		size_t children_size;
+		size_t partition(const X &x, size_t dim_v, size_t v, T threshold, size_t begin, size_t end)
+		{
+			for (size_t j = begin; j != end; ++j)
+			{
+				below_[rows_[j]] = XV(x, rows_[j], v, dim_v) < threshold;
+			}
 
-		in >> children_size;
+			size_t size_a = partition_observations(below_,
+					rows_.begin() + begin, rows_.begin() + end, scratch_.begin() + begin) - (rows_.begin() + begin);
 
-		expect(in, "{");
+			for (typename std::vector<std::vector<presorted_observation<T> > >::iterator
+					sorted_iter = sorted_.begin(); sorted_iter != sorted_.end(); ++sorted_iter)
+			{
+				if (! sorted_iter->empty())
+				{
+					partition_observations(below_,
+							sorted_iter->begin() + begin, sorted_iter->begin() + end, sorted_scratch_.begin() + begin);
+				}
+			}
 
-		for (size_t i = 0; i != children_size; ++i)
-		{
-			children_.push_back(regression_tree<T, Y, X, I, L>(in));
+			return size_a;
 		}
+	};
 
-		expect(in, "}");
-
-		expect(in, "}");
+	regression_tree(size_t dim_n, size_t dim_v):
+			dim_n_(dim_n), dim_v_(dim_v), node_type_(RT_NODE_TYPE_INVALID),
+			prediction_(), v_(), split_(), children_()
+	{
 	}
 
-	void train(const Y &y, const X &x, const I &i, const L &l, size_t n, std::ostream &log)
+	// Trains on the observations sample.rows_[begin, end), which are then
+	// partitioned in place between the children, along with the matching
+	// ranges of the presorted predictors. vs is scratch space for the order in
+	// which predictors are tried, shared by all nodes trained on one thread.
+	void train(const Y &y, const X &x, training_sample &sample, size_t begin, size_t end, size_t depth,
+			std::vector<size_t> &vs, const L &l, size_t n, const tree_limits &limits, uint64_t seed,
+			thread_budget *budget, std::ostream &log)
 	{
 #ifndef NDEBUG
 		FLEX_ASSERT(node_type_ == RT_NODE_TYPE_INVALID);
 #endif
 
 #ifdef LOG_OUTPUT
-		log << i.size() << " observation(s) of " << dim_v_ << " variable(s)" << std::endl;
+		log << (end - begin) << " observation(s) of " << dim_v_ << " variable(s)" << std::endl;
 #endif
 
-		T sigma_y = sigma<T, Y, I>(y, i);
+		typename I::iterator first = sample.rows_.begin() + begin;
+		typename I::iterator last = sample.rows_.begin() + end;
+
+		T mu_y = mu<T, Y, typename I::iterator>(y, first, last);
+		T sigma_y = sigma<T, Y, typename I::iterator>(y, first, last, mu_y);
 
 #ifdef LOG_OUTPUT
 		log << "H(Y): " << sigma_y << std::endl;
 #endif
 
-		std::vector<size_t> vs(dim_v_);
-
 		size_t j = 0;
 
 		for (std::vector<size_t>::iterator vs_iter = vs.begin(); vs_iter != vs.end(); ++vs_iter)
@@ -125,15 +241,18 @@ class regression_tree
 			(*vs_iter) = j++;
 		}
 
-		std::random_shuffle(vs.begin(), vs.end());
+		splitmix64 rng(seed);
+
+		rng.shuffle(vs);
 
 		T best_ig = T();
 		size_t best_v = 0;
 		node_type best_node_type = RT_NODE_TYPE_INVALID;
 		T best_split = T();
-		std::pair<I, I> best_ixs;
 
-		if (sigma_y > TOLERANCE_THRESHOLD)
+		if ((sigma_y > TOLERANCE_THRESHOLD)
+				&& (depth < limits.max_depth_)
+				&& ((end - begin) >= (2 * limits.min_leaf_size_)))
 		{
 			for (size_t j = 0; j != n; ++j)
 			{
@@ -141,34 +260,27 @@ class regression_tree
 
 				if (l[v] == 2)
 				{
-					std::pair<T, std::pair<I, I> > ig = ig_binary(sigma_y, y, x, dim_v_, v, i);
+					T ig = ig_binary_range(mu_y, y, x, dim_v_, v, first, last,
+							limits.min_leaf_size_);
 
 #ifdef LOG_OUTPUT
 #ifdef LOG_OUTPUT_VERBOSE_TRAINING
-					log << "IG(Y | X" << v << ") = " << ig.first << std::endl;
+					log << "IG(Y | X" << v << ") = " << ig << std::endl;
 #endif
 #endif
 
-					if (ig.first > best_ig)
+					if (ig > best_ig)
 					{
-						best_ig = ig.first;
+						best_ig = ig;
 						best_v = v;
 						best_node_type = RT_NODE_TYPE_BINARY;
 						best_split = T();
-						best_ixs = ig.second;
 					}
 				}
 				else if (l[v] == 0)
 				{
-					/*
-					std::pair<T, std::pair<T, std::pair<I, I> > > ig_0 =
-							ig_continuous(sigma_y, y, x, dim_v_, v, i);
-					*/
-
-					std::pair<T, std::pair<T, std::pair<I, I> > > ig =
-							ig_continuous_opt(sigma_y, y, x, dim_v_, v, i);
-
-					// assert(std::abs(ig_0.first - ig.first) < 0.001);
+					std::pair<T, std::pair<T, size_t> > ig = ig_continuous_presorted(mu_y, y,
+							sample.sorted_[v].begin() + begin, sample.sorted_[v].begin() + end, limits.min_leaf_size_);
 
 #ifdef LOG_OUTPUT
 #ifdef LOG_OUTPUT_VERBOSE_TRAINING
@@ -182,7 +294,6 @@ class regression_tree
 						best_v = v;
 						best_node_type = RT_NODE_TYPE_CONTINUOUS;
 						best_split = ig.second.first;
-						best_ixs = ig.second.second;
 					}
 				}
 				else
@@ -200,14 +311,14 @@ class regression_tree
 			}
 		}
 
-		if (best_ig <= TOLERANCE_THRESHOLD)
+		if ((best_node_type == RT_NODE_TYPE_INVALID) || (best_ig <= limits.min_gain_))
 		{
 #ifdef LOG_OUTPUT
 			log << "No information gain possible." << std::endl;
 #endif
 
 			node_type_ = RT_NODE_TYPE_LEAF;
-			prediction_ = mu<T, Y, I>(y, i);
+			prediction_ = mu_y;
 
 #ifdef LOG_OUTPUT
 			log << "H(Y): " << sigma_y << std::endl;
@@ -238,28 +349,78 @@ class regression_tree
 			node_type_ = best_node_type;
 			split_ = best_split;
 
-			children_.push_back(regression_tree(y, x, best_ixs.first, l, n, log));
-			children_.push_back(regression_tree(y, x, best_ixs.second, l, n, log));
+			size_t middle = begin + sample.partition(x, dim_v_, best_v,
+					(best_node_type == RT_NODE_TYPE_BINARY) ? BINARY_THRESHOLD : best_split, begin, end);
+
+			uint64_t seed_a = rng();
+			uint64_t seed_b = rng();
+
+			children_.reserve(2);
+			children_.push_back(regression_tree(dim_n_, dim_v_));
+			children_.push_back(regression_tree(dim_n_, dim_v_));
+
+			if ((budget != NULL)
+					&& ((middle - begin) >= PARALLEL_SUBTREE_MIN_SIZE)
+					&& ((end - middle) >= PARALLEL_SUBTREE_MIN_SIZE)
+					&& budget->acquire())
+			{
+				std::thread worker([&]()
+				{
+					std::vector<size_t> worker_vs(dim_v_);
+
+					children_[0].train(y, x, sample, begin, middle, depth + 1, worker_vs, l, n, limits, seed_a, budget, log);
+
+					budget->release();
+				});
+
+				children_[1].train(y, x, sample, middle, end, depth + 1, vs, l, n, limits, seed_b, budget, log);
+
+				worker.join();
+			}
+			else
+			{
+				children_[0].train(y, x, sample, begin, middle, depth + 1, vs, l, n, limits, seed_a, budget, log);
+				children_[1].train(y, x, sample, middle, end, depth + 1, vs, l, n, limits, seed_b, budget, log);
+			}
 		}
 	}
 
-	T predict(const X &x, size_t i = 0) const
+	public:
+	// The seed fully determines the tree for a given sample. With a budget,
+	// sibling subtrees of at least PARALLEL_SUBTREE_MIN_SIZE observations are
+	// trained concurrently whenever a spare thread is available.
+	regression_tree(const Y &y, const X &x, const I &i, const L &l, const presorted_predictors<T> &presorted,
+			size_t n, const tree_limits &limits, uint64_t seed, thread_budget *budget, std::ostream &log):
+			dim_n_(y.size()), dim_v_(x.size() / dim_n_), node_type_(RT_NODE_TYPE_INVALID),
+			prediction_(), v_(), split_(), children_()
 	{
-#ifndef NDEBUG
-		FLEX_ASSERT(node_type_ != RT_NODE_TYPE_INVALID);
-#endif
+		train(y, x, i, l, presorted, n, limits, seed, budget, log);
+	}
 
-		if (node_type_ == RT_NODE_TYPE_LEAF)
+	regression_tree(std::istream &in):
+			children_()
+	{
+		expect(in, "regression_tree");
+		expect(in, "{");
+
+		in >> dim_n_;
+		in >> dim_v_;
+
+		std::string node_type_str;
+
+		in >> node_type_str;
+
+		if (node_type_str == "RT_NODE_TYPE_LEAF")
 		{
-			return prediction_;
+			node_type_ = RT_NODE_TYPE_LEAF;
 		}
-		else if (node_type_ == RT_NODE_TYPE_BINARY)
+		else if (node_type_str == "RT_NODE_TYPE_BINARY")
 		{
-			return children_[(x[(i * dim_v_) + v_] < BINARY_THRESHOLD) ? 0 : 1].predict(x, i);
+			node_type_ = RT_NODE_TYPE_BINARY;
 		}
-		else if (node_type_ == RT_NODE_TYPE_CONTINUOUS)
+		else if (node_type_str == "RT_NODE_TYPE_CONTINUOUS")
 		{
-			return children_[(x[(i * dim_v_) + v_] < split_) ? 0 : 1].predict(x, i);
+			node_type_ = RT_NODE_TYPE_CONTINUOUS;
 		}
 		else
 		{
@@ -267,54 +428,68 @@ class regression_tree
 			FLEX_ASSERT(false);
 #endif
 
-			return T();
+			node_type_ = RT_NODE_TYPE_INVALID;
 		}
+
+		in >> prediction_;
+		in >> v_;
+		in >> split_;
+
+		size_t children_size;
+
+		in >> children_size;
+
+		expect(in, "{");
+
+		for (size_t i = 0; i != children_size; ++i)
+		{
+			children_.push_back(regression_tree<T, Y, X, I, L>(in));
+		}
+
+		expect(in, "}");
+
+		expect(in, "}");
 	}
 
-	void serialize(std::ostream &out) const
+	void train(const Y &y, const X &x, const I &i, const L &l, const presorted_predictors<T> &presorted,
+			size_t n, const tree_limits &limits, uint64_t seed, thread_budget *budget, std::ostream &log)
+	{
+		training_sample sample(i, presorted, dim_n_);
+		std::vector<size_t> vs(dim_v_);
+
+		train(y, x, sample, 0, i.size(), 0, vs, l, n, limits, seed, budget, log);
+	}
+
+	void flatten(std::vector<flat_node<T> > &nodes, size_t ix) const
 	{
 #ifndef NDEBUG
 		FLEX_ASSERT(node_type_ != RT_NODE_TYPE_INVALID);
 #endif
 
-		out << "regression_tree" << std::endl;
-		out << "{" << std::endl;
-
-		out << dim_n_ << " " << dim_v_ << std::endl;
-
 		if (node_type_ == RT_NODE_TYPE_LEAF)
 		{
-			out << "RT_NODE_TYPE_LEAF" << std::endl;
-		}
-		else if (node_type_ == RT_NODE_TYPE_BINARY)
-		{
-			out << "RT_NODE_TYPE_BINARY" << std::endl;
+			nodes[ix].set(FN_TYPE_LEAF, prediction_, 0, 0);
+
+			return;
 		}
-		else if (node_type_ == RT_NODE_TYPE_CONTINUOUS)
+
+		size_t child = nodes.size();
+
+		nodes.resize(child + children_.size());
+
+		if (node_type_ == RT_NODE_TYPE_BINARY)
 		{
-			out << "RT_NODE_TYPE_CONTINUOUS" << std::endl;
+			nodes[ix].set(FN_TYPE_BINARY, BINARY_THRESHOLD, v_, child);
 		}
 		else
 		{
-			out << "RT_NODE_TYPE_INVALID" << std::endl;
+			nodes[ix].set(FN_TYPE_CONTINUOUS, split_, v_, child);
 		}
 
-		out << prediction_ << std::endl;
-		out << v_ << std::endl;
-		out << split_ << std::endl;
-
-		out << children_.size() << std::endl;
-		out << "{" << std::endl;
-
-		for (typename std::vector<regression_tree<T, Y, X, I, L> >::const_iterator
-				child_iter = children_.begin(); child_iter != children_.end(); ++child_iter)
+		for (size_t j = 0; j != children_.size(); ++j)
 		{
-			child_iter->serialize(out);
+			children_[j].flatten(nodes, child + j);
 		}
-
-		out << "}" << std::endl;
-
-		out << "}" << std::endl;
 	}
 };
 
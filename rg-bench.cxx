@@ -0,0 +1,396 @@
+
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <istream>
+#include <ostream>
+#include <sstream>
+
+#include <cmath>
+#include <cstdlib>
+
+#include <algorithm>
+#include <chrono>
+#include <string>
+#include <vector>
+
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <unistd.h>
+
+#include "rg.hxx"
+
+#include "util.hxx"
+
+#include "mapped_file.hxx"
+#include "regression_grove.hxx"
+#include "training_data.hxx"
+
+typedef regression_grove<fp_type, std::vector<fp_type>, training_data, std::vector<size_t> > training_model_type;
+typedef regression_grove<fp_type, std::vector<fp_type>, std::vector<fp_type>, std::vector<size_t> > model_type;
+
+static double seconds_since(std::chrono::steady_clock::time_point start)
+{
+	return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+static long maxrss()
+{
+	rusage res_usage;
+
+	int status = getrusage(RUSAGE_SELF, &res_usage);
+
+	FLEX_ASSERT(status == 0);
+
+	return res_usage.ru_maxrss;
+}
+
+// Predictors of one synthetic observation: continuous ones uniform on [0, 10),
+// binary ones fair coin flips.
+static void generate_predictors(splitmix64 &rng, size_t continuous, size_t binary, fp_type *x)
+{
+	for (size_t j = 0; j != continuous; ++j)
+	{
+		x[j] = (rng() % 10000) / 1000.0;
+	}
+
+	for (size_t j = 0; j != binary; ++j)
+	{
+		x[continuous + j] = rng() % 2;
+	}
+}
+
+// Dependent variable: a mix of linear, non-linear and binary effects plus noise.
+static fp_type generate_y(splitmix64 &rng, size_t continuous, size_t binary, const fp_type *x)
+{
+	fp_type y = ((rng() % 1000) / 1000.0) - 0.5;
+
+	for (size_t j = 0; j != continuous; ++j)
+	{
+		y += (j % 2) ? std::sin(x[j]) : (0.5 * x[j]);
+	}
+
+	for (size_t j = 0; j != std::min<size_t>(binary, 8); ++j)
+	{
+		y += x[continuous + j] * ((j % 3) + 1);
+	}
+
+	return y;
+}
+
+// Writes contents to a new temporary file and returns its path.
+static std::string write_temp_file(const std::string &contents)
+{
+	const char *dir = std::getenv("TMPDIR");
+
+	std::string path_template = std::string((dir != NULL) ? dir : "/tmp") + "/rg-bench-XXXXXX";
+
+	std::vector<char> path(path_template.begin(), path_template.end());
+
+	path.push_back('\0');
+
+	int fd = mkstemp(&path[0]);
+
+	FLEX_ASSERT(fd != -1);
+
+	close(fd);
+
+	std::ofstream out(&path[0], std::ios::binary);
+
+	out.write(contents.data(), contents.size());
+	out.close();
+
+	FLEX_ASSERT(! out.fail());
+
+	return std::string(&path[0]);
+}
+
+// Seconds taken by one prediction per query, the first use of a freshly
+// loaded model.
+static double first_pass(const model_type &model, const std::vector<fp_type> &x, size_t queries, fp_type &checksum)
+{
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+	for (size_t i = 0; i != queries; ++i)
+	{
+		checksum += model.predict(x, i)[0];
+	}
+
+	return seconds_since(start);
+}
+
+static void report(const std::string &key, double value, bool last = false)
+{
+	std::cout << "\t\"" << key << "\": " << value << (last ? "" : ",") << std::endl;
+}
+
+// Times training, serialization, model loading and prediction on a synthetic
+// dataset laid out the way rg-train expects it (continuous predictors first,
+// binary ones after), and prints the results as a JSON object. Settings are
+// key=value arguments: rows, continuous, binary, trees, threads, seed,
+// queries, batch.
+int main(int argc, char **argv)
+{
+	size_t rows = 100000;
+	size_t continuous = 4;
+	size_t binary = 60;
+	size_t trees = 10;
+	size_t threads = 1;
+	uint64_t seed = 1;
+	size_t queries = 10000;
+	size_t batch = 1000;
+
+	for (int k = 1; k < argc; ++k)
+	{
+		std::string key, value;
+
+		bool known = parse_option(argv[k], key, value);
+
+		std::stringstream value_stream(value);
+
+		if (key == "rows")
+		{
+			value_stream >> rows;
+		}
+		else if (key == "continuous")
+		{
+			value_stream >> continuous;
+		}
+		else if (key == "binary")
+		{
+			value_stream >> binary;
+		}
+		else if (key == "trees")
+		{
+			value_stream >> trees;
+		}
+		else if (key == "threads")
+		{
+			value_stream >> threads;
+		}
+		else if (key == "seed")
+		{
+			value_stream >> seed;
+		}
+		else if (key == "queries")
+		{
+			value_stream >> queries;
+		}
+		else if (key == "batch")
+		{
+			value_stream >> batch;
+		}
+		else
+		{
+			known = false;
+		}
+
+#ifndef NDEBUG
+		FLEX_ASSERT(known);
+#endif
+	}
+
+#ifndef NDEBUG
+	FLEX_ASSERT((rows > 0) && (continuous + binary > 0) && (trees > 1) && (queries > 0) && (batch > 0));
+#endif
+
+	size_t dim_v = continuous + binary;
+
+	splitmix64 rng(seed);
+
+	std::vector<fp_type> row(dim_v);
+
+	std::stringstream data_text;
+
+	data_text << (dim_v + 1) << " " << rows << std::endl;
+
+	for (size_t i = 0; i != rows; ++i)
+	{
+		generate_predictors(rng, continuous, binary, &row[0]);
+
+		data_text << generate_y(rng, continuous, binary, &row[0]);
+
+		for (size_t j = 0; j != dim_v; ++j)
+		{
+			data_text << " " << row[j];
+		}
+
+		data_text << std::endl;
+	}
+
+	std::vector<fp_type> x(queries * dim_v);
+
+	for (size_t i = 0; i != queries; ++i)
+	{
+		generate_predictors(rng, continuous, binary, &x[i * dim_v]);
+	}
+
+	std::cout << std::setprecision(9);
+
+	std::cout << "{" << std::endl;
+
+	report("rows", rows);
+	report("continuous", continuous);
+	report("binary", binary);
+	report("trees", trees);
+	report("threads", threads);
+	report("queries", queries);
+	report("batch", batch);
+
+	std::string layout(continuous, '0');
+
+	layout += "2";
+
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+	training_data data;
+
+	data.read_text(data_text, layout);
+
+	report("data_text_read_s", seconds_since(start));
+
+	std::stringstream data_binary;
+
+	data.write_binary(data_binary);
+
+	start = std::chrono::steady_clock::now();
+
+	training_data data_copy;
+
+	data_copy.read_binary(data_binary);
+
+	report("data_binary_read_s", seconds_since(start));
+
+	training_options options;
+
+	options.threads_ = threads;
+	options.seed_ = seed;
+
+	start = std::chrono::steady_clock::now();
+
+	training_model_type trained(data.y(), data, data.l(), trees, std::cerr, options);
+
+	double train_s = seconds_since(start);
+
+	report("train_s", train_s);
+	report("train_trees_per_s", trees / train_s);
+	report("train_maxrss_kb", maxrss());
+
+	report("model_nodes", trained.node_count());
+	report("model_bytes", trained.bytes());
+
+	start = std::chrono::steady_clock::now();
+
+	std::stringstream model_text;
+
+	trained.serialize(model_text);
+
+	report("serialize_text_s", seconds_since(start));
+	report("model_text_bytes", model_text.str().size());
+
+	start = std::chrono::steady_clock::now();
+
+	std::stringstream model_binary_stream;
+
+	trained.serialize_binary(model_binary_stream);
+
+	std::string model_binary(model_binary_stream.str());
+
+	report("serialize_binary_s", seconds_since(start));
+	report("model_binary_bytes", model_binary.size());
+
+	// Both models are loaded from files the way rg-gearman-worker loads them.
+	// The files were just written, so their pages come from the page cache:
+	// the first pass over the mapped model pays for the page faults that
+	// mapping defers, but not for disk reads.
+	std::string model_text_path = write_temp_file(model_text.str());
+	std::string model_binary_path = write_temp_file(model_binary);
+
+	start = std::chrono::steady_clock::now();
+
+	std::ifstream model_text_file(model_text_path.c_str());
+
+	model_type model(model_text_file);
+
+	report("load_text_s", seconds_since(start));
+
+	start = std::chrono::steady_clock::now();
+
+	mapped_file model_image(model_binary_path);
+
+	model_type model_mapped(model_image.data(), model_image.size());
+
+	report("load_binary_s", seconds_since(start));
+
+	unlink(model_text_path.c_str());
+	unlink(model_binary_path.c_str());
+
+	fp_type checksum = fp_type();
+
+	report("first_pass_text_s", first_pass(model, x, queries, checksum));
+	report("first_pass_binary_s", first_pass(model_mapped, x, queries, checksum));
+
+	std::vector<double> latencies(queries);
+
+	for (size_t i = 0; i != queries; ++i)
+	{
+		start = std::chrono::steady_clock::now();
+
+		std::vector<fp_type> predictions = model_mapped.predict(x, i);
+
+		latencies[i] = seconds_since(start) * 1e6;
+
+		checksum += predictions[0];
+	}
+
+	std::sort(latencies.begin(), latencies.end());
+
+	double latency_total = 0;
+
+	for (size_t i = 0; i != queries; ++i)
+	{
+		latency_total += latencies[i];
+	}
+
+	report("predict_rows_per_s", queries / (latency_total / 1e6));
+	report("predict_latency_p50_us", latencies[queries / 2]);
+	report("predict_latency_p90_us", latencies[(queries * 9) / 10]);
+	report("predict_latency_p99_us", latencies[(queries * 99) / 100]);
+	report("predict_latency_max_us", latencies[queries - 1]);
+
+	std::vector<fp_type> batch_predictions(batch * model_mapped.size());
+	std::vector<double> batch_latencies;
+
+	double batch_total = 0;
+	size_t batch_rows = 0;
+
+	for (size_t i = 0; i < queries; i += batch)
+	{
+		size_t count = std::min(batch, queries - i);
+
+		start = std::chrono::steady_clock::now();
+
+		model_mapped.predict_batch(x, i, count, &batch_predictions[0]);
+
+		batch_latencies.push_back(seconds_since(start) * 1e6);
+
+		batch_total += batch_latencies.back();
+		batch_rows += count;
+
+		checksum += batch_predictions[0];
+	}
+
+	std::sort(batch_latencies.begin(), batch_latencies.end());
+
+	report("predict_batch_rows_per_s", batch_rows / (batch_total / 1e6));
+	report("predict_batch_latency_p50_us", batch_latencies[batch_latencies.size() / 2]);
+	report("predict_batch_latency_p99_us", batch_latencies[(batch_latencies.size() * 99) / 100]);
+
+	report("checksum", checksum);
+	report("maxrss_kb", maxrss(), true);
+
+	std::cout << "}" << std::endl;
+
+	return 0;
+}
+
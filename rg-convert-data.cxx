@@ -0,0 +1,49 @@
+
+#include <iostream>
+#include <istream>
+#include <ostream>
+
+#include <string>
+
+#include "rg.hxx"
+
+#include "util.hxx"
+
+#include "training_data.hxx"
+
+// Converts a text dataset (as read by rg-train) on stdin into the binary
+// dataset format on stdout. An optional argument gives the predictor layout,
+// see training_data::read_text.
+int main(int argc, char **argv)
+{
+#ifndef NDEBUG
+	FLEX_ASSERT((argc == 1) || (argc == 2));
+#endif
+
+	std::string layout((argc > 1) ? argv[1] : DEFAULT_TEXT_LAYOUT);
+
+#ifdef LOG_OUTPUT_BASIC
+	std::cerr << "Reading training data..." << std::endl;
+#endif
+
+	training_data data;
+
+	data.read_text(std::cin, layout);
+
+#ifdef LOG_OUTPUT_BASIC
+	std::cerr << "Done." << std::endl;
+#endif
+
+#ifdef LOG_OUTPUT_BASIC
+	std::cerr << "Writing binary training data..." << std::endl;
+#endif
+
+	data.write_binary(std::cout);
+
+#ifdef LOG_OUTPUT_BASIC
+	std::cerr << "Done." << std::endl;
+#endif
+
+	return 0;
+}
+
@@ -0,0 +1,124 @@
+
+#include <fstream>
+#include <iostream>
+#include <istream>
+#include <ostream>
+
+#include <string>
+#include <vector>
+
+#include "rg.hxx"
+
+#include "util.hxx"
+
+#include "regression_grove.hxx"
+#include "training_data.hxx"
+
+// Converts a text model (as written by rg-train) on stdin into the binary
+// model format on stdout, compacting it on the way. Optional key=value
+// arguments set up quantization, see set_compaction_option, and data=<file>
+// names a dataset (text or binary, as rg-train reads it) to measure the
+// accuracy of the model on before and after compaction.
+int main(int argc, char **argv)
+{
+	compaction_options compaction;
+	std::string data_path;
+
+	for (int k = 1; k < argc; ++k)
+	{
+		std::string key, value;
+
+		bool known = parse_option(argv[k], key, value);
+
+		if (key == "data")
+		{
+			data_path = value;
+		}
+		else
+		{
+			known = known && set_compaction_option(compaction, key, value);
+		}
+
+#ifndef NDEBUG
+		FLEX_ASSERT(known);
+#endif
+	}
+
+	training_data data;
+
+	if (! data_path.empty())
+	{
+#ifdef LOG_OUTPUT_BASIC
+		std::cerr << "Reading data..." << std::endl;
+#endif
+
+		std::ifstream data_stream(data_path.c_str(), std::ios::binary);
+
+#ifndef NDEBUG
+		FLEX_ASSERT(data_stream.good());
+#endif
+
+		data.read(data_stream, DEFAULT_TEXT_LAYOUT);
+
+#ifdef LOG_OUTPUT_BASIC
+		std::cerr << "Done." << std::endl;
+#endif
+	}
+
+#ifdef LOG_OUTPUT_BASIC
+	std::cerr << "Loading model..." << std::endl;
+#endif
+
+	regression_grove<fp_type, std::vector<fp_type>, std::vector<fp_type>, std::vector<size_t> >
+			rg(std::cin);
+
+#ifdef LOG_OUTPUT_BASIC
+	std::cerr << "Done." << std::endl;
+#endif
+
+#ifndef NDEBUG
+	FLEX_ASSERT(data_path.empty() || (data.size() == data.y().size() * rg.v()));
+#endif
+
+#ifdef LOG_OUTPUT_BASIC
+	std::vector<fp_type> before = rg.predict_mean(data, data.y().size());
+
+	std::cerr << "Compacting model: " << rg.node_count() << " nodes, " << rg.bytes() << " bytes";
+
+	if (! data_path.empty())
+	{
+		std::cerr << ", RMSE " << rms_difference<fp_type>(before, data.y());
+	}
+
+	std::cerr << "..." << std::endl;
+#endif
+
+	rg.compact(compaction);
+
+#ifdef LOG_OUTPUT_BASIC
+	std::vector<fp_type> after = rg.predict_mean(data, data.y().size());
+
+	std::cerr << "Done: " << rg.node_count() << " nodes, " << rg.bytes() << " bytes";
+
+	if (! data_path.empty())
+	{
+		std::cerr << ", RMSE " << rms_difference<fp_type>(after, data.y())
+				<< " (RMS change " << rms_difference<fp_type>(after, before) << ")";
+	}
+
+	std::cerr << "." << std::endl;
+#endif
+
+#ifdef LOG_OUTPUT_BASIC
+	std::cerr << "Writing binary model..." << std::endl;
+#endif
+
+	rg.serialize_binary(std::cout);
+
+#ifdef LOG_OUTPUT_BASIC
+	std::cerr << "Done." << std::endl;
+#endif
+
+	return 0;
+}
+
@@ -5,14 +5,19 @@
 #include <ostream>
 #include <sstream>
 
+#include <cctype>
 #include <cstdlib>
 #include <cstring>
 #include <ctime>
 
 #include <algorithm>
+#include <chrono>
 #include <string>
+#include <thread>
 #include <vector>
 
+#include <pthread.h>
+#include <signal.h>
 #include <sys/time.h>
 #include <sys/resource.h>
 
@@ -21,72 +26,90 @@
 #include "util.hxx"
 
 #include "gearman.hxx"
+#include "mapped_file.hxx"
 #include "regression_grove.hxx"
+#include "serving_stats.hxx"
 
 static const int worker_timeout = 10;
 
-static long long jobs_processed = 0;
+typedef regression_grove<fp_type, std::vector<fp_type>, std::vector<fp_type>, std::vector<size_t> > model_type;
 
-void *predict(gearman_job_st *job, void *context, size_t *result_size, gearman_return_t *ret_ptr)
-{
-#ifdef LOG_OUTPUT_BASIC
-	std::cerr << "Job taken..." << std::endl;
-#endif
+// Shared by all serving threads, reported by the "stats" function and on SIGUSR1.
+static function_stats predict_stats;
+static function_stats predict_batch_stats;
 
-	regression_grove<fp_type, std::vector<fp_type>, std::vector<fp_type>, std::vector<size_t> > *model =
-			static_cast<regression_grove<fp_type, std::vector<fp_type>, std::vector<fp_type>, std::vector<size_t> > *>(context);
+static const model_stats *loaded_model_stats = NULL;
 
-	char *inp_char = static_cast<char *>(std::malloc(gearman_job_workload_size(job) + 1));
+static const std::chrono::steady_clock::time_point started = std::chrono::steady_clock::now();
 
-	std::memcpy(inp_char, gearman_job_workload(job), gearman_job_workload_size(job));
+// Reads whitespace-separated predictors from the job workload, at most limit of
+// them. Returns false if anything but whitespace is left after the last one.
+static bool parse_predictors(gearman_job_st *job, std::vector<fp_type> &predictors, size_t limit)
+{
+	size_t size = gearman_job_workload_size(job);
 
-	inp_char[gearman_job_workload_size(job)] = '\0';
+	char *inp_char = static_cast<char *>(std::malloc(size + 1));
 
-	std::string input(inp_char);
+	std::memcpy(inp_char, gearman_job_workload(job), size);
+
+	inp_char[size] = '\0';
 
 #ifdef LOG_OUTPUT
-	std::cerr << "Predictors: " << input << std::endl;
+	std::cerr << "Predictors: " << inp_char << std::endl;
 #endif
 
-	std::stringstream input_stream(input);
-
-	std::vector<fp_type> predictors(model->v());
+	char *pos = inp_char;
 
-	for (size_t i = 0; i != model->v(); ++i)
+	while (predictors.size() != limit)
 	{
-		input_stream >> predictors[i];
+		char *end;
+
+		fp_type value = std::strtod(pos, &end);
+
+		if (end == pos)
+		{
+			break;
+		}
+
+		predictors.push_back(value);
+
+		pos = end;
 	}
 
-	free(inp_char);
+	while (std::isspace(static_cast<unsigned char>(*pos)))
+	{
+		++pos;
+	}
 
-	std::vector<fp_type> predictions = model->predict(predictors, 0);
+	bool complete = (*pos == '\0');
 
-	std::sort(predictions.begin(), predictions.end());
+	free(inp_char);
 
-	std::stringstream result_stream;
+	return complete;
+}
 
-	result_stream << "[\"";
+// Writes one observation's predictions, sorted, as a quoted space-separated list.
+static void format_predictions(std::ostream &out, fp_type *first, fp_type *last)
+{
+	std::sort(first, last);
 
-	bool frist = true;
+	out << "\"";
 
-	for (std::vector<fp_type>::const_iterator pred_iter = predictions.begin(); pred_iter != predictions.end(); ++pred_iter)
+	for (fp_type *pred_iter = first; pred_iter != last; ++pred_iter)
 	{
-		if (frist)
-		{
-			frist = false;
-		}
-		else
+		if (pred_iter != first)
 		{
-			result_stream << " ";
+			out << " ";
 		}
 
-		result_stream << (*pred_iter);
+		out << (*pred_iter);
 	}
 
-	result_stream << "\"]";
+	out << "\"";
+}
 
-	std::string result(result_stream.str());
-	
+static void *respond(const std::string &result, size_t *result_size, gearman_return_t *ret_ptr)
+{
 #ifdef LOG_OUTPUT
 	std::cerr << "Predictions: " << result << std::endl;
 #endif
@@ -99,20 +122,214 @@ void *predict(gearman_job_st *job, void *context, size_t *result_size, gearman_r
 
 	*ret_ptr = GEARMAN_SUCCESS;
 
-#ifdef LOG_OUTPUT_BASIC
+	return res_char;
+}
+
+void *predict(gearman_job_st *job, void *context, size_t *result_size, gearman_return_t *ret_ptr)
+{
+#ifdef LOG_OUTPUT
+	std::cerr << "Job taken..." << std::endl;
+#endif
+
+	job_timer timer(predict_stats);
+
+	model_type *model = static_cast<model_type *>(context);
+
+	std::vector<fp_type> predictors;
+
+	predictors.reserve(model->v());
+
+	parse_predictors(job, predictors, model->v());
+
+	predictors.resize(model->v());
+
+	timer.phase(JOB_PHASE_PARSE);
+
+	std::vector<fp_type> predictions = model->predict(predictors, 0);
+
+	timer.phase(JOB_PHASE_PREDICT);
+
+	std::stringstream result_stream;
+
+	result_stream << "[";
+
+	format_predictions(result_stream, &predictions[0], &predictions[0] + predictions.size());
+
+	result_stream << "]";
+
+	void *result = respond(result_stream.str(), result_size, ret_ptr);
+
+	timer.phase(JOB_PHASE_FORMAT);
+	timer.done(1);
+
+#ifdef LOG_OUTPUT
 	std::cerr << "Complete." << std::endl;
 #endif
 
-	++jobs_processed;
+	return result;
+}
 
-	return res_char;
+// Same as predict, for any number of observations per job: the workload holds
+// the predictors of each observation in turn, and the result is a JSON array
+// with one entry per observation, each formatted the way predict formats its
+// single entry.
+void *predict_batch(gearman_job_st *job, void *context, size_t *result_size, gearman_return_t *ret_ptr)
+{
+#ifdef LOG_OUTPUT
+	std::cerr << "Batch job taken..." << std::endl;
+#endif
+
+	job_timer timer(predict_batch_stats);
+
+	model_type *model = static_cast<model_type *>(context);
+
+	std::vector<fp_type> predictors;
+
+	bool complete = parse_predictors(job, predictors, static_cast<size_t>(-1));
+
+	// A token that is not a number would silently drop the rest of the batch,
+	// so it fails the job just like a partial last row does.
+	if ((! complete) || (predictors.size() % model->v() != 0))
+	{
+		predict_batch_stats.failure();
+
+		*ret_ptr = GEARMAN_WORK_FAIL;
+
+		return NULL;
+	}
+
+	timer.phase(JOB_PHASE_PARSE);
+
+	size_t count = predictors.size() / model->v();
+
+	std::vector<fp_type> predictions(count * model->size());
+
+	if (count > 0)
+	{
+		model->predict_batch(predictors, 0, count, &predictions[0]);
+	}
+
+	timer.phase(JOB_PHASE_PREDICT);
+
+	std::stringstream result_stream;
+
+	result_stream << "[";
+
+	for (size_t i = 0; i != count; ++i)
+	{
+		if (i != 0)
+		{
+			result_stream << ",";
+		}
+
+		format_predictions(result_stream,
+				&predictions[0] + (i * model->size()), &predictions[0] + ((i + 1) * model->size()));
+	}
+
+	result_stream << "]";
+
+	void *result = respond(result_stream.str(), result_size, ret_ptr);
+
+	timer.phase(JOB_PHASE_FORMAT);
+	timer.done(count);
+
+#ifdef LOG_OUTPUT
+	std::cerr << "Complete." << std::endl;
+#endif
+
+	return result;
+}
+
+static void write_stats(std::ostream &out)
+{
+	rusage res_usage;
+
+	int status = getrusage(RUSAGE_SELF, &res_usage);
+
+	FLEX_ASSERT(status == 0);
+
+	out << "{\"uptime_s\": " << std::chrono::duration_cast<std::chrono::seconds>(
+			std::chrono::steady_clock::now() - started).count();
+	out << ", \"maxrss_kb\": " << res_usage.ru_maxrss;
+	out << ", \"model\": ";
+
+	loaded_model_stats->write_json(out);
+
+	out << ", \"functions\": {\"predict\": ";
+
+	predict_stats.write_json(out);
+
+	out << ", \"predict_batch\": ";
+
+	predict_batch_stats.write_json(out);
+
+	out << "}}";
+}
+
+// Model shape, memory use and per-phase job latencies as a JSON object. The
+// workload is ignored.
+void *stats(gearman_job_st *, void *, size_t *result_size, gearman_return_t *ret_ptr)
+{
+	std::stringstream result_stream;
+
+	write_stats(result_stream);
+
+	return respond(result_stream.str(), result_size, ret_ptr);
+}
+
+// Dumps the stats to stderr on every SIGUSR1, which all other threads block.
+void dump_stats_on_signal(sigset_t signals)
+{
+	while (true)
+	{
+		int signal;
+
+		if (sigwait(&signals, &signal) == 0)
+		{
+			write_stats(std::cerr);
+
+			std::cerr << std::endl;
+		}
+	}
+}
+
+void serve(gearman_worker_st *worker)
+{
+	while (true)
+	{
+		GEARMAN(gearman_worker_work(worker));
+	}
 }
 
 int main(int argc, char **argv)
 {
+	// Blocked before anything else, so that a SIGUSR1 arriving while the
+	// model loads stays pending for dump_stats_on_signal instead of
+	// terminating the worker, and every thread started later inherits the
+	// mask.
+	sigset_t signals;
+
+	sigemptyset(&signals);
+	sigaddset(&signals, SIGUSR1);
+
+	pthread_sigmask(SIG_BLOCK, &signals, NULL);
+
+#ifndef NDEBUG
+	FLEX_ASSERT((argc == 3) || (argc == 4));
+#endif
+
+	size_t thread_num = 1;
+
+	if (argc > 3)
+	{
+		std::stringstream thread_num_stream(argv[3]);
+
+		thread_num_stream >> thread_num;
+
 #ifndef NDEBUG
-	FLEX_ASSERT(argc == 3);
+		FLEX_ASSERT(thread_num > 0);
 #endif
+	}
 
 	std::srand(std::time(NULL));
 
@@ -120,25 +337,57 @@ int main(int argc, char **argv)
 	std::cerr << "Loading model..." << std::endl;
 #endif
 
-	std::ifstream model(argv[1]);
+	std::ifstream model(argv[1], std::ios::binary);
+
+	model_type *rg;
+
+	if (is_flat_grove(model))
+	{
+		// Binary models are used in place and stay mapped for the lifetime of the worker.
+		mapped_file *image = new mapped_file(argv[1]);
+
+		rg = new model_type(image->data(), image->size());
+	}
+	else
+	{
+		rg = new model_type(model);
+	}
 
-	regression_grove<fp_type, std::vector<fp_type>, std::vector<fp_type>, std::vector<size_t> >
-			rg(model);
+	loaded_model_stats = new model_stats(*rg);
 
 #ifdef LOG_OUTPUT_BASIC
-	std::cerr << "Done." << std::endl;
+	std::cerr << "Done: ";
+
+	loaded_model_stats->write_json(std::cerr);
+
+	std::cerr << std::endl;
 #endif
 
 #ifdef LOG_OUTPUT_BASIC
-	std::cerr << "Initializing gearman worker..." << std::endl;
+	std::cerr << "Initializing " << thread_num << " gearman worker(s)..." << std::endl;
 #endif
 
-	gearman_worker_st *worker = gearman_worker_create(NULL);
+	// One connection per serving thread, all of them predicting from the same
+	// read-only model.
+	std::vector<gearman_worker_st *> workers;
+
+	for (size_t i = 0; i != thread_num; ++i)
+	{
+		gearman_worker_st *worker = gearman_worker_create(NULL);
+
+		GEARMAN(gearman_worker_add_servers(worker, argv[2]));
+
+		GEARMAN(gearman_worker_add_function(worker, "predict", worker_timeout,
+				&predict, static_cast<void *>(rg)));
+
+		GEARMAN(gearman_worker_add_function(worker, "predict_batch", worker_timeout,
+				&predict_batch, static_cast<void *>(rg)));
 
-	GEARMAN(gearman_worker_add_servers(worker, argv[2]));
+		GEARMAN(gearman_worker_add_function(worker, "stats", worker_timeout,
+				&stats, NULL));
 
-	GEARMAN(gearman_worker_add_function(worker, "predict", worker_timeout,
-			&predict, static_cast<void *>(&rg)));
+		workers.push_back(worker);
+	}
 
 #ifdef LOG_OUTPUT_BASIC
 	std::cerr << "Done." << std::endl;
@@ -148,21 +397,15 @@ int main(int argc, char **argv)
 	std::cerr << "Ready." << std::endl;
 #endif
 
-	while (true)
-	{
-		rusage res_usage;
-
-		FLEX_ASSERT(getrusage(RUSAGE_SELF, &res_usage) == 0);
-
-#ifdef LOG_OUTPUT_BASIC
-		std::cerr << " maxrss: " << res_usage.ru_maxrss;
-		std::cerr << " (jobs processed: " << jobs_processed << ")";
-		std::cerr << std::endl;
-#endif
+	std::thread(&dump_stats_on_signal, signals).detach();
 
-		GEARMAN(gearman_worker_work(worker));
+	for (size_t i = 1; i != thread_num; ++i)
+	{
+		std::thread(&serve, workers[i]).detach();
 	}
 
+	serve(workers[0]);
+
 	return 0;
 }
 
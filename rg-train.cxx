@@ -15,13 +15,12 @@
 #include "util.hxx"
 
 #include "regression_grove.hxx"
+#include "training_data.hxx"
 
 int main(int argc, char **argv)
 {
-	std::srand(std::time(NULL));
-
 #ifndef NDEBUG
-	FLEX_ASSERT(argc == 2);
+	FLEX_ASSERT(argc >= 2);
 #endif
 
 	std::string tree_num_str(argv[1]);
@@ -36,57 +35,151 @@ int main(int argc, char **argv)
 	FLEX_ASSERT(tree_num > 1);
 #endif
 
-#ifdef LOG_OUTPUT_BASIC
-	std::cerr << "Reading training data..." << std::endl;
+	// Optional: number of training threads and a seed to reproduce a grove,
+	// followed by key=value settings for tree limits and compaction. A
+	// compacted model is written in the binary format, which is the only one
+	// that keeps shared subtrees and quantized values as they are.
+	training_options options;
+	compaction_options compaction;
+	bool compact = false;
+
+	options.seed_ = std::time(NULL);
+
+	for (int k = 2; k < argc; ++k)
+	{
+		std::string key, value;
+
+		if (! parse_option(argv[k], key, value))
+		{
+			std::stringstream arg_stream(argv[k]);
+
+			if (k == 2)
+			{
+				arg_stream >> options.threads_;
+
+#ifndef NDEBUG
+				FLEX_ASSERT(options.threads_ > 0);
 #endif
+			}
+			else if (k == 3)
+			{
+				arg_stream >> options.seed_;
+			}
+			else
+			{
+#ifndef NDEBUG
+				FLEX_ASSERT(false);
+#endif
+			}
 
-	size_t n, v;
+			continue;
+		}
 
-	std::cin >> v;
-	std::cin >> n;
+		std::stringstream value_stream(value);
 
-	std::vector<fp_type> y(n);
-	std::vector<fp_type> x(n * (v - 1));
+		if (key == "max_depth")
+		{
+			value_stream >> options.limits_.max_depth_;
+		}
+		else if (key == "min_leaf")
+		{
+			value_stream >> options.limits_.min_leaf_size_;
 
-	for (size_t i = 0; i != n; ++i)
-	{
-		std::cin >> y[i];
+#ifndef NDEBUG
+			FLEX_ASSERT(options.limits_.min_leaf_size_ > 0);
+#endif
+		}
+		else if (key == "parallel_subtrees")
+		{
+			value_stream >> options.parallel_subtrees_;
+		}
+		else if (key == "min_gain")
+		{
+			value_stream >> options.limits_.min_gain_;
 
-		for (size_t j = 0; j != (v - 1); ++j)
+#ifndef NDEBUG
+			FLEX_ASSERT(options.limits_.min_gain_ >= 0);
+#endif
+		}
+		else if (key == "compact")
 		{
-			std::cin >> x[IX(i, j, v - 1)];
+			value_stream >> compact;
+		}
+		else
+		{
+			compact = true;
+
+			bool known = set_compaction_option(compaction, key, value);
+
+#ifndef NDEBUG
+			FLEX_ASSERT(known);
+#endif
 		}
 	}
 
 #ifdef LOG_OUTPUT_BASIC
-	std::cerr << "Done." << std::endl;
+	std::cerr << "Reading training data..." << std::endl;
 #endif
 
-	// TODO: levels should be generated by the data provider
-	std::vector<size_t> l(v - 1);
+	// Binary datasets declare their own predictor types, text ones are
+	// assumed to follow the fixed layout.
+	training_data data;
 
-	for (size_t i = 0; i != (v - 1); ++i)
-	{
-		// Fixed variable layout for my dataset. Four first continuous, the rest are binary.
-		l[i] = (i < 4) ? 0 : 2;
-	}
+	data.read(std::cin, DEFAULT_TEXT_LAYOUT);
+
+#ifdef LOG_OUTPUT_BASIC
+	std::cerr << "Done." << std::endl;
+#endif
 
 #ifdef LOG_OUTPUT_BASIC
 	std::cerr << "Training regression grove..." << std::endl;
 #endif
 
-	regression_grove<fp_type, std::vector<fp_type>, std::vector<fp_type>, std::vector<size_t> >
-			rg(y, x, l, tree_num, std::cerr);
+	regression_grove<fp_type, std::vector<fp_type>, training_data, std::vector<size_t> >
+			rg(data.y(), data, data.l(), tree_num, std::cerr, options);
 
 #ifdef LOG_OUTPUT_BASIC
 	std::cerr << "Done." << std::endl;
 #endif
 
+	if (compact)
+	{
 #ifdef LOG_OUTPUT_BASIC
-	std::cerr << "Serializing model..." << std::endl;
+		// Quantization trades accuracy for size, so the size is reported next
+		// to the error on the training data and how far predictions moved.
+		std::vector<fp_type> before = rg.predict_mean(data, data.y().size());
+
+		std::cerr << "Compacting model: " << rg.node_count() << " nodes, " << rg.bytes() << " bytes, training RMSE "
+				<< rms_difference<fp_type>(before, data.y()) << "..." << std::endl;
 #endif
 
-	rg.serialize(std::cout);
+		rg.compact(compaction);
+
+#ifdef LOG_OUTPUT_BASIC
+		std::vector<fp_type> after = rg.predict_mean(data, data.y().size());
+
+		std::cerr << "Done: " << rg.node_count() << " nodes, " << rg.bytes() << " bytes, training RMSE "
+				<< rms_difference<fp_type>(after, data.y()) << " (RMS change " << rms_difference<fp_type>(after, before)
+				<< ")." << std::endl;
+#endif
+	}
+
+	if (compact)
+	{
+#ifdef LOG_OUTPUT_BASIC
+		std::cerr << "Writing binary model..." << std::endl;
+#endif
+
+		rg.serialize_binary(std::cout);
+	}
+	else
+	{
+#ifdef LOG_OUTPUT_BASIC
+		std::cerr << "Serializing model..." << std::endl;
+#endif
+
+		rg.serialize(std::cout);
+	}
 
 #ifdef LOG_OUTPUT_BASIC
 	std::cerr << "Done." << std::endl;
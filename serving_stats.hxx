@@ -0,0 +1,291 @@
+
+#ifndef INCLUDE__SERVING_STATS_HXX
+
+#define INCLUDE__SERVING_STATS_HXX
+
+#include <ostream>
+
+#include <stdint.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <map>
+#include <string>
+#include <utility>
+
+#include "util.hxx"
+
+static const size_t HISTOGRAM_SUB_BITS = 3;
+static const size_t HISTOGRAM_SUB_BUCKETS = 1 << HISTOGRAM_SUB_BITS;
+static const size_t HISTOGRAM_LINEAR = 2 * HISTOGRAM_SUB_BUCKETS;
+static const size_t HISTOGRAM_BUCKETS = HISTOGRAM_LINEAR + ((64 - HISTOGRAM_SUB_BITS - 1) * HISTOGRAM_SUB_BUCKETS);
+
+// Lock-free log-linear histogram of durations in nanoseconds: exact below
+// HISTOGRAM_LINEAR, then HISTOGRAM_SUB_BUCKETS buckets per power of two, so
+// any reported percentile is within 1 / HISTOGRAM_SUB_BUCKETS of the truth.
+// Recording is a couple of relaxed atomic increments, plus a compare and
+// swap on the rare occasions the maximum, which is kept exact, goes up.
+class latency_histogram
+{
+	private:
+	std::atomic<uint64_t> buckets_[HISTOGRAM_BUCKETS];
+	std::atomic<uint64_t> count_, sum_, max_;
+
+	latency_histogram(const latency_histogram &);
+	latency_histogram &operator=(const latency_histogram &);
+
+	static size_t bucket(uint64_t ns)
+	{
+		if (ns < HISTOGRAM_LINEAR)
+		{
+			return ns;
+		}
+
+		size_t e = 63 - __builtin_clzll(ns);
+
+		return HISTOGRAM_LINEAR + ((e - HISTOGRAM_SUB_BITS - 1) * HISTOGRAM_SUB_BUCKETS)
+				+ ((ns >> (e - HISTOGRAM_SUB_BITS)) & (HISTOGRAM_SUB_BUCKETS - 1));
+	}
+
+	// Smallest value that falls into bucket b.
+	static uint64_t lower_bound(size_t b)
+	{
+		if (b < HISTOGRAM_LINEAR)
+		{
+			return b;
+		}
+
+		size_t e = ((b - HISTOGRAM_LINEAR) / HISTOGRAM_SUB_BUCKETS) + HISTOGRAM_SUB_BITS + 1;
+		size_t sub = (b - HISTOGRAM_LINEAR) % HISTOGRAM_SUB_BUCKETS;
+
+		return static_cast<uint64_t>(HISTOGRAM_SUB_BUCKETS + sub) << (e - HISTOGRAM_SUB_BITS);
+	}
+
+	public:
+	latency_histogram():
+			count_(0), sum_(0), max_(0)
+	{
+		for (size_t b = 0; b != HISTOGRAM_BUCKETS; ++b)
+		{
+			buckets_[b].store(0, std::memory_order_relaxed);
+		}
+	}
+
+	inline void record(uint64_t ns)
+	{
+		buckets_[bucket(ns)].fetch_add(1, std::memory_order_relaxed);
+		count_.fetch_add(1, std::memory_order_relaxed);
+		sum_.fetch_add(ns, std::memory_order_relaxed);
+
+		uint64_t max = max_.load(std::memory_order_relaxed);
+
+		while ((ns > max) && (! max_.compare_exchange_weak(max, ns, std::memory_order_relaxed)))
+		{
+		}
+	}
+
+	uint64_t count() const
+	{
+		return count_.load(std::memory_order_relaxed);
+	}
+
+	uint64_t mean() const
+	{
+		uint64_t count = count_.load(std::memory_order_relaxed);
+
+		return (count == 0) ? 0 : (sum_.load(std::memory_order_relaxed) / count);
+	}
+
+	uint64_t max() const
+	{
+		return max_.load(std::memory_order_relaxed);
+	}
+
+	// Upper bound of the bucket holding the p-th percentile (0 < p <= 1).
+	// Taken while jobs are being recorded, so only approximately consistent.
+	uint64_t percentile(double p) const
+	{
+		uint64_t count = count_.load(std::memory_order_relaxed);
+		uint64_t rank = std::max<uint64_t>(1, static_cast<uint64_t>(p * count));
+		uint64_t seen = 0;
+
+		for (size_t b = 0; b != HISTOGRAM_BUCKETS; ++b)
+		{
+			seen += buckets_[b].load(std::memory_order_relaxed);
+
+			if (seen >= rank)
+			{
+				return (b + 1 == HISTOGRAM_BUCKETS) ? lower_bound(b) : (lower_bound(b + 1) - 1);
+			}
+		}
+
+		return 0;
+	}
+
+	void write_json(std::ostream &out) const
+	{
+		out << "{\"count\": " << count()
+				<< ", \"mean_ns\": " << mean()
+				<< ", \"p50_ns\": " << percentile(0.5)
+				<< ", \"p90_ns\": " << percentile(0.9)
+				<< ", \"p99_ns\": " << percentile(0.99)
+				<< ", \"p999_ns\": " << percentile(0.999)
+				<< ", \"max_ns\": " << max() << "}";
+	}
+};
+
+enum job_phase
+{
+	JOB_PHASE_PARSE,
+	JOB_PHASE_PREDICT,
+	JOB_PHASE_FORMAT,
+	JOB_PHASE_TOTAL,
+	JOB_PHASE_NUM
+};
+
+static const char *const JOB_PHASE_NAMES[JOB_PHASE_NUM] = { "parse", "predict", "format", "total" };
+
+// Per Gearman function: job, observation and failure counts, and a latency
+// histogram per job phase.
+class function_stats
+{
+	private:
+	std::atomic<uint64_t> jobs_, rows_, failures_;
+	latency_histogram phases_[JOB_PHASE_NUM];
+
+	function_stats(const function_stats &);
+	function_stats &operator=(const function_stats &);
+
+	public:
+	function_stats():
+			jobs_(0), rows_(0), failures_(0)
+	{
+	}
+
+	inline void job(uint64_t rows)
+	{
+		jobs_.fetch_add(1, std::memory_order_relaxed);
+		rows_.fetch_add(rows, std::memory_order_relaxed);
+	}
+
+	inline void failure()
+	{
+		failures_.fetch_add(1, std::memory_order_relaxed);
+	}
+
+	inline void record(job_phase phase, uint64_t ns)
+	{
+		phases_[phase].record(ns);
+	}
+
+	uint64_t jobs() const
+	{
+		return jobs_.load(std::memory_order_relaxed);
+	}
+
+	void write_json(std::ostream &out) const
+	{
+		out << "{\"jobs\": " << jobs()
+				<< ", \"rows\": " << rows_.load(std::memory_order_relaxed)
+				<< ", \"failures\": " << failures_.load(std::memory_order_relaxed);
+
+		for (size_t phase = 0; phase != JOB_PHASE_NUM; ++phase)
+		{
+			out << ", \"" << JOB_PHASE_NAMES[phase] << "\": ";
+
+			phases_[phase].write_json(out);
+		}
+
+		out << "}";
+	}
+};
+
+// Times consecutive phases of one job into a function_stats.
+class job_timer
+{
+	private:
+	function_stats &stats_;
+	std::chrono::steady_clock::time_point start_, phase_start_;
+
+	static uint64_t ns(std::chrono::steady_clock::time_point from, std::chrono::steady_clock::time_point to)
+	{
+		return std::chrono::duration_cast<std::chrono::nanoseconds>(to - from).count();
+	}
+
+	public:
+	job_timer(function_stats &stats):
+			stats_(stats), start_(std::chrono::steady_clock::now()), phase_start_(start_)
+	{
+	}
+
+	inline void phase(job_phase phase)
+	{
+		std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+
+		stats_.record(phase, ns(phase_start_, now));
+
+		phase_start_ = now;
+	}
+
+	inline void done(uint64_t rows)
+	{
+		stats_.record(JOB_PHASE_TOTAL, ns(start_, std::chrono::steady_clock::now()));
+		stats_.job(rows);
+	}
+};
+
+// Shape of a loaded model, computed once.
+struct model_stats
+{
+	size_t trees_, nodes_, bytes_;
+	size_t min_depth_, max_depth_;
+	double mean_depth_;
+	size_t min_tree_bytes_, max_tree_bytes_;
+	double mean_tree_bytes_;
+	std::map<size_t, size_t> depths_;
+
+	template<typename G>
+	model_stats(const G &grove):
+			trees_(grove.size()), nodes_(grove.node_count()), bytes_(grove.bytes()),
+			min_depth_(0), max_depth_(0), mean_depth_(0),
+			min_tree_bytes_(0), max_tree_bytes_(0), mean_tree_bytes_(0), depths_()
+	{
+		for (size_t t = 0; t != trees_; ++t)
+		{
+			std::pair<size_t, size_t> shape = grove.tree_shape(t);
+
+			size_t tree_bytes = shape.first;
+
+			min_depth_ = (t == 0) ? shape.second : std::min(min_depth_, shape.second);
+			max_depth_ = std::max(max_depth_, shape.second);
+			mean_depth_ += static_cast<double>(shape.second) / trees_;
+
+			min_tree_bytes_ = (t == 0) ? tree_bytes : std::min(min_tree_bytes_, tree_bytes);
+			max_tree_bytes_ = std::max(max_tree_bytes_, tree_bytes);
+			mean_tree_bytes_ += static_cast<double>(tree_bytes) / trees_;
+
+			++depths_[shape.second];
+		}
+	}
+
+	void write_json(std::ostream &out) const
+	{
+		out << "{\"trees\": " << trees_
+				<< ", \"nodes\": " << nodes_
+				<< ", \"bytes\": " << bytes_
+				<< ", \"depth\": {\"min\": " << min_depth_ << ", \"mean\": " << mean_depth_ << ", \"max\": " << max_depth_
+				<< ", \"trees_by_depth\": {";
+
+		for (std::map<size_t, size_t>::const_iterator depth_iter = depths_.begin(); depth_iter != depths_.end(); ++depth_iter)
+		{
+			out << ((depth_iter == depths_.begin()) ? "" : ", ") << "\"" << depth_iter->first << "\": " << depth_iter->second;
+		}
+
+		out << "}}, \"tree_bytes\": {\"min\": " << min_tree_bytes_ << ", \"mean\": " << mean_tree_bytes_
+				<< ", \"max\": " << max_tree_bytes_ << "}}";
+	}
+};
+
+#endif
+
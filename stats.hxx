@@ -8,219 +8,218 @@
 #include <algorithm>
 #include <iterator>
 #include <utility>
+#include <vector>
 
 #include "util.hxx"
 
 static const fp_type BINARY_THRESHOLD = 0.5;
 
-template<typename T, typename Y, typename I>
-inline T mu(const Y &y, const I &i)
+template<typename T, typename Y, typename It>
+inline T mu(const Y &y, It first, It last)
 {
 	T acc = T();
 
-	for (typename I::const_iterator i_iter = i.begin(); i_iter != i.end(); ++i_iter)
+	for (It i_iter = first; i_iter != last; ++i_iter)
 	{
 		acc += y[*i_iter];
 	}
 
-	return acc / i.size();
+	return acc / (last - first);
 }
 
-template<typename T, typename Y, typename I>
-inline T sigma(const Y &y, const I &i)
+// Mean squared deviation of the observations in [first, last) from mean.
+template<typename T, typename Y, typename It>
+inline T sigma(const Y &y, It first, It last, T mean)
 {
 	T acc = T();
 
-	if (i.size() == 0)
+	if (first == last)
 	{
 		return acc;
 	}
 
-	T mean = mu<T, Y, I>(y, i);
-
-	for (typename I::const_iterator i_iter = i.begin(); i_iter != i.end(); ++i_iter)
+	for (It i_iter = first; i_iter != last; ++i_iter)
 	{
-		acc += std::pow((y[*i_iter] - mean), 2);
+		T d = y[*i_iter] - mean;
+
+		acc += d * d;
 	}
 
-	return acc / i.size();
+	return acc / (last - first);
 }
 
-template<typename T, typename Y, typename X, typename I>
-inline std::pair<T, std::pair<I, I> > ig_binary(
-		T sigma_y, const Y &y, const X &x, size_t v_num, size_t v, const I &i)
+// Root mean squared difference of two sequences of the same length.
+template<typename T, typename A, typename B>
+inline T rms_difference(const A &a, const B &b)
 {
-	std::pair<I, I> ixs;
+	T acc = T();
 
-	for (typename I::const_iterator i_iter = i.begin(); i_iter != i.end(); ++i_iter)
+	if (a.empty())
 	{
-		if (x[IX(*i_iter, v, v_num)] < BINARY_THRESHOLD)
-		{
-			ixs.first.push_back(*i_iter);
-		}
-		else
-		{
-			ixs.second.push_back(*i_iter);
-		}
+		return acc;
 	}
 
-	T ig = T();
-
-	if ((ixs.first.size() > 0) && (ixs.second.size() > 0))
+	for (size_t i = 0; i != a.size(); ++i)
 	{
-		size_t total_len = i.size();
+		T d = a[i] - b[i];
 
-		ig = sigma_y
-				- (sigma<T, Y, I>(y, ixs.first) * ixs.first.size() / total_len)
-				- (sigma<T, Y, I>(y, ixs.second) * ixs.second.size() / total_len);
+		acc += d * d;
 	}
 
-	return make_pair(ig, ixs);
+	return std::sqrt(acc / a.size());
 }
 
-template<typename X>
-class xv_comparator
+// Value of a continuous predictor for one observation, stored next to the
+// observation so that scans over a presorted predictor read it sequentially.
+template<typename T>
+struct presorted_observation
 {
-	private:
-	size_t v_num_, v_;
-	const X &x_;
-
-	public:
-	xv_comparator(const X &x, size_t v_num, size_t v):
-			v_num_(v_num), v_(v), x_(x)
-	{
-	}
+	T x_;
+	size_t i_;
 
-	inline bool operator()(size_t a, size_t b) const
+	inline bool operator<(const presorted_observation &other) const
 	{
-		return x_[IX(a, v_, v_num_)] > x_[IX(b, v_, v_num_)];
+		return x_ < other.x_;
 	}
 };
 
-template<typename T, typename Y, typename X, typename I>
-inline std::pair<T, std::pair<T, std::pair<I, I> > > ig_continuous(
-		T sigma_y, const Y &y, const X &x, size_t v_num, size_t v, const I &i)
+inline size_t observation(size_t i)
 {
-	size_t total_len = i.size();
+	return i;
+}
 
-	I sorted_i(i);
-	
-	std::sort(sorted_i.begin(), sorted_i.end(), xv_comparator<X>(x, v_num, v));
+template<typename T>
+inline size_t observation(const presorted_observation<T> &o)
+{
+	return o.i_;
+}
 
-	T best_ig = T();
-	std::pair<I, I> best_ixs;
-	T best_split = T();
+// Information gain of a split of n observations into size_a and n - size_a,
+// acc_a being the sum of the deviations from the mean on the first side.
+// The deviations sum to zero, so the other side's sum is -acc_a, and the gain
+// (the variance between both sides) comes out as acc_a^2 / (size_a * size_b).
+template<typename T>
+inline T ig_split(T acc_a, size_t size_a, size_t size_b)
+{
+	return (acc_a * acc_a) / (static_cast<T>(size_a) * size_b);
+}
 
-	T ig = T();
-	std::pair<I, I> ixs;
-	ixs.second = sorted_i;
-	T split = x[IX(ixs.second.back(), v, v_num)];
+// Information gain of splitting the observations in [first, last) on binary
+// predictor v, in one pass and without building either partition. Splits
+// leaving fewer than min_size observations on either side gain nothing.
+template<typename T, typename Y, typename X, typename It>
+inline T ig_binary_range(T mu_y, const Y &y, const X &x, size_t v_num, size_t v, It first, It last,
+		size_t min_size = 1)
+{
+	size_t size_b = 0;
+	T acc_b = T();
 
-	while (true)
+	for (It i_iter = first; i_iter != last; ++i_iter)
 	{
-		while ((ixs.second.size() > 0) && (x[IX(ixs.second.back(), v, v_num)] == split))
-		{
-			ixs.first.push_back(ixs.second.back());
-			ixs.second.pop_back();
-		}
-
-		if (ixs.second.size() == 0)
-		{
-			break;
-		}
+		size_t b = (XV(x, *i_iter, v, v_num) < BINARY_THRESHOLD) ? 0 : 1;
 
-		split = x[IX(ixs.second.back(), v, v_num)];
+		size_b += b;
+		acc_b += b * (y[*i_iter] - mu_y);
+	}
 
-		ig = sigma_y
-				- (sigma<T, Y, I>(y, ixs.first) * ixs.first.size() / total_len)
-				- (sigma<T, Y, I>(y, ixs.second) * ixs.second.size() / total_len);
+	size_t size_a = (last - first) - size_b;
 
-		if (ig > best_ig)
-		{
-			best_ig = ig;
-			best_ixs = ixs;
-			best_split = split;
-		}
+	if ((size_a == 0) || (size_b == 0) || (size_a < min_size) || (size_b < min_size))
+	{
+		return T();
 	}
 
-	return make_pair(best_ig, make_pair(best_split, best_ixs));
+	return ig_split(acc_b, size_a, size_b);
 }
 
-template<typename T, typename Y, typename X, typename I>
-inline std::pair<T, std::pair<T, std::pair<I, I> > > ig_continuous_opt(
-		T sigma_y, const Y &y, const X &x, size_t v_num, size_t v, const I &i)
+// Best split of a range of presorted_observation in ascending order of the
+// predictor: one scan that moves observations across the split, so nothing is
+// sorted or copied. Returns the information gain, the split value and the
+// number of observations below the split. Only splits leaving at least
+// min_size observations on both sides are considered.
+template<typename T, typename Y, typename It>
+inline std::pair<T, std::pair<T, size_t> > ig_continuous_presorted(T mu_y, const Y &y, It first, It last,
+		size_t min_size = 1)
 {
-	size_t total_len = i.size();
+	size_t total_len = last - first;
 
-	I sorted_i(i);
-	
-	std::sort(sorted_i.begin(), sorted_i.end(), xv_comparator<X>(x, v_num, v));
-
-	T best_ig = T();
-	std::pair<I, I> best_ixs;
+	// Gains compare as fractions, acc_a^2 over size_a * size_b, so that the
+	// scan needs no division per candidate.
+	T best_acc_a = T();
+	T best_sizes = 1;
 	T best_split = T();
+	size_t best_size_a = 0;
 
-	T ig = T();
-	std::pair<I, I> ixs;
-	ixs.second = sorted_i;
-	T split = x[IX(ixs.second.back(), v, v_num)];
-
-	T mu_a = T();
-	T sigma_a = T();
-	T mu_b = mu<T, Y, I>(y, i);
-	T sigma_b = sigma<T, Y, I>(y, i) * i.size();
+	T acc_a = T();
 	size_t size_a = 0;
-	size_t size_b = i.size();
 
-	bool frist = true;
+	It i_iter = first;
 
-	while (true)
+	while (i_iter != last)
 	{
-		while ((ixs.second.size() > 0) && (x[IX(ixs.second.back(), v, v_num)] == split))
+		T split = i_iter->x_;
+
+		while ((i_iter != last) && (i_iter->x_ == split))
 		{
-			ixs.first.push_back(ixs.second.back());
-			ixs.second.pop_back();
+			acc_a += y[i_iter->i_] - mu_y;
 
 			++size_a;
-			--size_b;
-
-			if (frist)
-			{
-				frist = false;
-
-				mu_a = y[ixs.first.back()];
-				sigma_a = 0;
-			}
-			else
-			{
-				T mu_a_old = mu_a;
-				mu_a = mu_a_old + ((y[ixs.first.back()] - mu_a_old) / size_a);
-				sigma_a = sigma_a + ((y[ixs.first.back()] - mu_a_old) * (y[ixs.first.back()] - mu_a));
-			}
-
-			T mu_b_old = mu_b;
-			mu_b = (((size_b + 1) * mu_b_old) - y[ixs.first.back()]) / (size_b);
-			sigma_b = sigma_b - ((y[ixs.first.back()] - mu_b_old) * (y[ixs.first.back()] - mu_b));
+			++i_iter;
 		}
 
-		if (ixs.second.size() == 0)
+		size_t size_b = total_len - size_a;
+
+		if ((i_iter == last) || (size_b < min_size))
 		{
 			break;
 		}
 
-		split = x[IX(ixs.second.back(), v, v_num)];
+		if (size_a < min_size)
+		{
+			continue;
+		}
 
-		ig = sigma_y - (sigma_a / total_len) - (sigma_b / total_len);
+		T sizes = static_cast<T>(size_a) * size_b;
 
-		if (ig > best_ig)
+		if ((acc_a * acc_a * best_sizes) > (best_acc_a * best_acc_a * sizes))
 		{
-			best_ig = ig;
-			best_ixs = ixs;
-			best_split = split;
+			best_acc_a = acc_a;
+			best_sizes = sizes;
+			best_split = i_iter->x_;
+			best_size_a = size_a;
 		}
 	}
 
-	return make_pair(best_ig, make_pair(best_split, best_ixs));
+	T best_ig = (best_acc_a * best_acc_a) / best_sizes;
+
+	return std::make_pair(best_ig, std::make_pair(best_split, best_size_a));
+}
+
+// Stable partition of [first, last) into the observations flagged in below
+// followed by the rest. The right-hand side is staged in scratch, which must
+// have room for last - first elements.
+template<typename It>
+inline It partition_observations(const std::vector<char> &below, It first, It last, It scratch)
+{
+	It left = first;
+	It right = scratch;
+
+	// Every element is written to both sides and only one of them advances,
+	// which avoids a mispredicted branch per element.
+	for (It i_iter = first; i_iter != last; ++i_iter)
+	{
+		size_t b = below[observation(*i_iter)];
+
+		*left = *i_iter;
+		*right = *i_iter;
+
+		left += b;
+		right += 1 - b;
+	}
+
+	std::copy(scratch, right, left);
+
+	return left;
 }
 
 #endif
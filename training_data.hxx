@@ -0,0 +1,424 @@
+
+#ifndef INCLUDE__TRAINING_DATA_HXX
+
+#define INCLUDE__TRAINING_DATA_HXX
+
+#include <istream>
+#include <ostream>
+
+#include <cctype>
+#include <cstdlib>
+#include <cstring>
+#include <stdint.h>
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include "util.hxx"
+
+#include "stats.hxx"
+
+static const char TRAINING_DATA_MAGIC[8] = { 'R', 'G', 'D', 'A', 'T', 'A', 'B', 'N' };
+static const uint32_t TRAINING_DATA_VERSION = 1;
+static const uint32_t TRAINING_DATA_BYTE_ORDER = 0x01020304;
+
+static const size_t TEXT_READER_CHUNK = 1 << 20;
+
+// Predictor layout of the text datasets this was written for: four continuous
+// predictors, binary ones after that.
+static const std::string DEFAULT_TEXT_LAYOUT = "00002";
+
+// Binary dataset layout: this header, dim_v_ predictor levels as uint32_t
+// (padded to a multiple of eight bytes), dim_n_ values of the dependent
+// variable, then one column per predictor: dim_n_ values for continuous
+// predictors (level 0), or (dim_n_ + 63) / 64 words of packed bits for binary
+// ones (level 2). Host byte order throughout.
+struct training_data_header
+{
+	char magic_[8];
+	uint32_t version_;
+	uint32_t byte_order_;
+	uint32_t value_size_;
+	uint32_t reserved_;
+	uint64_t dim_n_, dim_v_;
+};
+
+// Whether the first size bytes of a stream, usually sizeof(TRAINING_DATA_MAGIC)
+// of them, start a binary dataset.
+inline bool is_training_data(const char *data, size_t size)
+{
+	return (size >= sizeof(TRAINING_DATA_MAGIC))
+			&& (std::memcmp(data, TRAINING_DATA_MAGIC, sizeof(TRAINING_DATA_MAGIC)) == 0);
+}
+
+// Whitespace-separated numbers from a stream, parsed a chunk at a time.
+class text_reader
+{
+	private:
+	std::istream &in_;
+	std::vector<char> buf_;
+	size_t pos_, len_;
+	bool eof_;
+
+	void refill()
+	{
+		len_ -= pos_;
+
+		std::memmove(&buf_[0], &buf_[pos_], len_);
+
+		pos_ = 0;
+
+		if (len_ + 1 == buf_.size())
+		{
+			buf_.resize(buf_.size() * 2);
+		}
+
+		in_.read(&buf_[len_], buf_.size() - len_ - 1);
+
+		if (in_.gcount() == 0)
+		{
+			eof_ = true;
+		}
+
+		len_ += in_.gcount();
+		buf_[len_] = '\0';
+	}
+
+	public:
+	// Characters already taken from the stream are passed in as prefix.
+	text_reader(std::istream &in, const std::string &prefix = std::string()):
+			in_(in), buf_(std::max(TEXT_READER_CHUNK, prefix.size()) + 1), pos_(0), len_(prefix.size()), eof_(false)
+	{
+		std::copy(prefix.begin(), prefix.end(), buf_.begin());
+
+		buf_[len_] = '\0';
+	}
+
+	bool next(fp_type &value)
+	{
+		while (true)
+		{
+			while ((pos_ != len_) && std::isspace(buf_[pos_]))
+			{
+				++pos_;
+			}
+
+			size_t end = pos_;
+
+			while ((end != len_) && (! std::isspace(buf_[end])))
+			{
+				++end;
+			}
+
+			if ((end == len_) && (! eof_))
+			{
+				refill();
+
+				continue;
+			}
+
+			if (end == pos_)
+			{
+				return false;
+			}
+
+			value = std::strtod(&buf_[pos_], NULL);
+			pos_ = end;
+
+			return true;
+		}
+	}
+};
+
+// Training set with per-column storage: continuous predictors as plain
+// columns, binary predictors packed one bit per observation.
+class training_data
+{
+	private:
+	size_t dim_n_, dim_v_;
+	std::vector<size_t> l_;
+	std::vector<fp_type> y_;
+	std::vector<std::vector<fp_type> > continuous_;
+	std::vector<std::vector<uint64_t> > binary_;
+
+	static size_t words(size_t n)
+	{
+		return (n + 63) / 64;
+	}
+
+	void init(size_t n, const std::vector<size_t> &l)
+	{
+		dim_n_ = n;
+		dim_v_ = l.size();
+		l_ = l;
+		y_.assign(n, fp_type());
+		continuous_.assign(dim_v_, std::vector<fp_type>());
+		binary_.assign(dim_v_, std::vector<uint64_t>());
+
+		for (size_t v = 0; v != dim_v_; ++v)
+		{
+			if (l_[v] == 2)
+			{
+				binary_[v].assign(words(n), 0);
+			}
+			else
+			{
+#ifndef NDEBUG
+				FLEX_ASSERT(l_[v] == 0);
+#endif
+
+				continuous_[v].assign(n, fp_type());
+			}
+		}
+	}
+
+	void set(size_t i, size_t v, fp_type value)
+	{
+		if (l_[v] == 2)
+		{
+			if (! (value < BINARY_THRESHOLD))
+			{
+				binary_[v][i / 64] |= static_cast<uint64_t>(1) << (i % 64);
+			}
+		}
+		else
+		{
+			continuous_[v][i] = value;
+		}
+	}
+
+	template<typename V>
+	static void read_array(std::istream &in, std::vector<V> &a)
+	{
+		if (! a.empty())
+		{
+			in.read(reinterpret_cast<char *>(&a[0]), a.size() * sizeof(V));
+		}
+
+#ifndef NDEBUG
+		FLEX_ASSERT(static_cast<size_t>(in.gcount()) == a.size() * sizeof(V));
+#endif
+	}
+
+	template<typename V>
+	static void write_array(std::ostream &out, const std::vector<V> &a)
+	{
+		if (! a.empty())
+		{
+			out.write(reinterpret_cast<const char *>(&a[0]), a.size() * sizeof(V));
+		}
+	}
+
+	void read_text(text_reader &reader, const std::string &layout)
+	{
+		fp_type v_value = fp_type();
+		fp_type n_value = fp_type();
+
+		reader.next(v_value);
+		reader.next(n_value);
+
+		size_t v = v_value;
+		size_t n = n_value;
+
+#ifndef NDEBUG
+		FLEX_ASSERT((v > 1) && (! layout.empty()));
+#endif
+
+		std::vector<size_t> l(v - 1);
+
+		for (size_t j = 0; j != (v - 1); ++j)
+		{
+			l[j] = layout[std::min(j, layout.size() - 1)] - '0';
+		}
+
+		init(n, l);
+
+		for (size_t i = 0; i != n; ++i)
+		{
+			fp_type value = fp_type();
+
+			reader.next(value);
+
+			y_[i] = value;
+
+			for (size_t j = 0; j != dim_v_; ++j)
+			{
+				value = fp_type();
+
+				reader.next(value);
+
+				set(i, j, value);
+			}
+		}
+	}
+
+	// Everything after a header that has already been read.
+	void read_binary(std::istream &in, const training_data_header &header)
+	{
+#ifndef NDEBUG
+		FLEX_ASSERT(header.version_ == TRAINING_DATA_VERSION);
+		FLEX_ASSERT(header.byte_order_ == TRAINING_DATA_BYTE_ORDER);
+		FLEX_ASSERT(header.value_size_ == sizeof(fp_type));
+#endif
+
+		std::vector<uint32_t> levels(header.dim_v_ + (header.dim_v_ % 2));
+
+		read_array(in, levels);
+
+		init(header.dim_n_, std::vector<size_t>(levels.begin(), levels.begin() + header.dim_v_));
+
+		read_array(in, y_);
+
+		for (size_t v = 0; v != dim_v_; ++v)
+		{
+			if (l_[v] == 2)
+			{
+				read_array(in, binary_[v]);
+			}
+			else
+			{
+				read_array(in, continuous_[v]);
+			}
+		}
+	}
+
+	public:
+	typedef fp_type value_type;
+
+	training_data():
+			dim_n_(0), dim_v_(0), l_(), y_(), continuous_(), binary_()
+	{
+	}
+
+	// The text format read by rg-train: the number of variables (including
+	// the dependent one), the number of observations, then each observation's
+	// dependent variable followed by its predictors. The text carries no
+	// types, so a layout string gives the level of each predictor ('0'
+	// continuous, '2' binary), its last character repeating to the end.
+	void read_text(std::istream &in, const std::string &layout)
+	{
+		text_reader reader(in);
+
+		read_text(reader, layout);
+	}
+
+	void read_binary(std::istream &in)
+	{
+		training_data_header header;
+
+		in.read(reinterpret_cast<char *>(&header), sizeof(header));
+
+#ifndef NDEBUG
+		FLEX_ASSERT(in.gcount() == sizeof(header));
+		FLEX_ASSERT(is_training_data(header.magic_, sizeof(header.magic_)));
+#endif
+
+		read_binary(in, header);
+	}
+
+	// Reads a binary dataset if the stream starts with the full
+	// TRAINING_DATA_MAGIC, and text in the given layout otherwise. The
+	// characters taken to look for the magic are handed on to the text
+	// reader, so this works on pipes.
+	void read(std::istream &in, const std::string &layout)
+	{
+		training_data_header header;
+
+		in.read(header.magic_, sizeof(header.magic_));
+
+		size_t peeked = in.gcount();
+
+		if (is_training_data(header.magic_, peeked))
+		{
+			size_t rest = sizeof(header) - sizeof(header.magic_);
+
+			in.read(reinterpret_cast<char *>(&header) + sizeof(header.magic_), rest);
+
+#ifndef NDEBUG
+			FLEX_ASSERT(static_cast<size_t>(in.gcount()) == rest);
+#endif
+
+			read_binary(in, header);
+		}
+		else
+		{
+			in.clear();
+
+			text_reader reader(in, std::string(header.magic_, peeked));
+
+			read_text(reader, layout);
+		}
+	}
+
+	void write_binary(std::ostream &out) const
+	{
+		training_data_header header;
+
+		std::memset(&header, 0, sizeof(header));
+		std::memcpy(header.magic_, TRAINING_DATA_MAGIC, sizeof(TRAINING_DATA_MAGIC));
+		header.version_ = TRAINING_DATA_VERSION;
+		header.byte_order_ = TRAINING_DATA_BYTE_ORDER;
+		header.value_size_ = sizeof(fp_type);
+		header.dim_n_ = dim_n_;
+		header.dim_v_ = dim_v_;
+
+		out.write(reinterpret_cast<const char *>(&header), sizeof(header));
+
+		std::vector<uint32_t> levels(l_.begin(), l_.end());
+
+		levels.resize(dim_v_ + (dim_v_ % 2));
+
+		write_array(out, levels);
+		write_array(out, y_);
+
+		for (size_t v = 0; v != dim_v_; ++v)
+		{
+			if (l_[v] == 2)
+			{
+				write_array(out, binary_[v]);
+			}
+			else
+			{
+				write_array(out, continuous_[v]);
+			}
+		}
+	}
+
+	inline fp_type value(size_t i, size_t v) const
+	{
+		if (l_[v] == 2)
+		{
+			return ((binary_[v][i / 64] >> (i % 64)) & 1) ? 1 : 0;
+		}
+		else
+		{
+			return continuous_[v][i];
+		}
+	}
+
+	// Number of observations times number of predictors, as for a row-major
+	// predictor matrix, so dimensions are derived the same way for both.
+	size_t size() const
+	{
+		return dim_n_ * dim_v_;
+	}
+
+	const std::vector<fp_type> &y() const
+	{
+		return y_;
+	}
+
+	const std::vector<size_t> &l() const
+	{
+		return l_;
+	}
+};
+
+inline fp_type XV(const training_data &x, size_t i, size_t j, size_t)
+{
+	return x.value(i, j);
+}
+
+#endif
+
@@ -8,9 +8,11 @@
 #include <ostream>
 
 #include <cassert>
+#include <stdint.h>
 
 #include <exception>
 #include <string>
+#include <utility>
 
 #ifdef FATAL_ASSERTION_FAILURES
 #define FLEX_ASSERT(x) assert(x);
@@ -24,6 +26,71 @@ inline T IX(T i, T j, T w)
 	return (i * w) + j;
 }
 
+// Value of variable j in observation i of a row-major predictor matrix of
+// width w. Other predictor storage provides its own overload.
+template<typename X>
+inline typename X::value_type XV(const X &x, size_t i, size_t j, size_t w)
+{
+	return x[IX(i, j, w)];
+}
+
+// Small, cheaply seeded generator (SplitMix64). Training gives every tree and
+// every split its own instance, so the model depends only on the seed and not
+// on how the work was spread across threads.
+class splitmix64
+{
+	private:
+	uint64_t state_;
+
+	public:
+	explicit splitmix64(uint64_t seed):
+			state_(seed)
+	{
+	}
+
+	static inline uint64_t mix(uint64_t z)
+	{
+		z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+		z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+
+		return z ^ (z >> 31);
+	}
+
+	inline uint64_t operator()()
+	{
+		state_ += 0x9e3779b97f4a7c15ULL;
+
+		return mix(state_);
+	}
+
+	// Fisher-Yates, spelled out so that the order does not depend on the
+	// standard library's distributions.
+	template<typename V>
+	void shuffle(V &v)
+	{
+		for (size_t k = v.size(); k > 1; --k)
+		{
+			std::swap(v[k - 1], v[(*this)() % k]);
+		}
+	}
+};
+
+// Splits a "key=value" command line argument, returning false if it has no '='.
+inline bool parse_option(const std::string &arg, std::string &key, std::string &value)
+{
+	size_t eq = arg.find('=');
+
+	if (eq == std::string::npos)
+	{
+		return false;
+	}
+
+	key = arg.substr(0, eq);
+	value = arg.substr(eq + 1);
+
+	return true;
+}
+
 inline void expect(std::istream &in, const std::string &str)
 {
 	std::string tag;